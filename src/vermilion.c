@@ -68,10 +68,23 @@
 
 #include "xf86Priv.h"
 
+/* Servers from 1.7 on resolve symbols lazily and dropped the lists. */
+#include "xorgVersion.h"
+#if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1,6,99,0,0)
+#define VERMILION_SYMLISTS
+#endif
+
 #define KERNELNAME "Vermilion Range"
 #define PROCFB "/proc/fb"
 #define DEVFB "/dev/fb"
 
+/*
+ * Scanline setup cost of a shadow damage box, in pixels.
+ */
+#define VERMILION_DEFAULT_SHADOW_COALESCE 64
+
+#define VERMILION_MAX_SHADOW_THREADS 16
+
 /* Mandatory functions */
 static const OptionInfoRec *VERMILIONAvailableOptions(int chipid, int busid);
 static void VERMILIONIdentify(int flags);
@@ -146,7 +159,16 @@ static PciChipsets VERMILIONPCIchipsets[] = {
 typedef enum
 {
     OPTION_SHADOWFB,
+    OPTION_SHADOW_STREAMING,
+    OPTION_SHADOW_COALESCE,
+    OPTION_SHADOW_TILEHASH,
+    OPTION_SHADOW_THREADS,
+    OPTION_SHADOW_ASYNC,
+    OPTION_SHADOW_MBX,
     OPTION_ACCEL,
+    OPTION_ACCEL_METHOD,
+    OPTION_CPU_THRESHOLD,
+    OPTION_ACCEL_THREAD,
     OPTION_FUSEDCLOCK,
     OPTION_PANELTYPE,
     OPTION_DEBUG
@@ -154,7 +176,16 @@ typedef enum
 
 static const OptionInfoRec VERMILIONOptions[] = {
     {OPTION_SHADOWFB, "ShadowFB", OPTV_BOOLEAN, {0}, FALSE},
+    {OPTION_SHADOW_STREAMING, "ShadowStreaming", OPTV_BOOLEAN, {0}, FALSE},
+    {OPTION_SHADOW_COALESCE, "ShadowCoalesce", OPTV_INTEGER, {0}, FALSE},
+    {OPTION_SHADOW_TILEHASH, "ShadowTileHash", OPTV_BOOLEAN, {0}, FALSE},
+    {OPTION_SHADOW_THREADS, "ShadowThreads", OPTV_INTEGER, {0}, FALSE},
+    {OPTION_SHADOW_ASYNC, "ShadowAsync", OPTV_BOOLEAN, {0}, FALSE},
+    {OPTION_SHADOW_MBX, "ShadowMBX", OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_ACCEL, "Accel", OPTV_BOOLEAN, {0}, FALSE},
+    {OPTION_ACCEL_METHOD, "AccelMethod", OPTV_STRING, {0}, FALSE},
+    {OPTION_CPU_THRESHOLD, "CPUThreshold", OPTV_INTEGER, {0}, FALSE},
+    {OPTION_ACCEL_THREAD, "AccelThread", OPTV_BOOLEAN, {0}, FALSE},
     {OPTION_FUSEDCLOCK, "FusedClock", OPTV_INTEGER, {0}, FALSE},
     {OPTION_PANELTYPE, "PanelType", OPTV_INTEGER, {0}, FALSE},
     {OPTION_DEBUG, "Debug", OPTV_BOOLEAN, {0}, FALSE},
@@ -170,6 +201,7 @@ static const OptionInfoRec VERMILIONOptions[] = {
  * unresolved symbols that are not required.
  */
 
+#ifdef VERMILION_SYMLISTS
 static const char *fbSymbols[] = {
     "fbPictureInit",
     "fbScreenInit",
@@ -199,11 +231,23 @@ static const char *xaaSymbols[] = {
     NULL
 };
 
+static const char *exaSymbols[] = {
+    "exaDriverAlloc",
+    "exaDriverInit",
+    "exaDriverFini",
+    "exaGetPixmapDriverPrivate",
+    "exaGetPixmapOffset",
+    "exaGetPixmapPitch",
+    "exaWaitSync",
+    NULL
+};
+
 static const char *ddcSymbols[] = {
     "xf86PrintEDID",
     "xf86SetDDCproperties",
     NULL
 };
+#endif
 
 #ifdef XFree86LOADER
 
@@ -239,8 +283,10 @@ vermilionSetup(pointer Module, pointer Options, int *ErrorMajor,
     if (!Initialised) {
 	Initialised = TRUE;
 	xf86AddDriver(&VERMILION, Module, 0);
-	LoaderRefSymLists(fbSymbols, wfbSymbols, ddcSymbols, shadowSymbols, xaaSymbols,
-	    NULL);
+#ifdef VERMILION_SYMLISTS
+	LoaderRefSymLists(fbSymbols, wfbSymbols, ddcSymbols, shadowSymbols,
+	    xaaSymbols, exaSymbols, NULL);
+#endif
 	return (pointer) TRUE;
     }
 
@@ -329,8 +375,11 @@ VERMILIONProbe(DriverPtr drv, int flags)
 static VERMILIONPtr
 VERMILIONGetRec(ScrnInfoPtr pScrn)
 {
-    if (!pScrn->driverPrivate)
+    if (!pScrn->driverPrivate) {
 	pScrn->driverPrivate = xcalloc(sizeof(VERMILIONRec), 1);
+	if (pScrn->driverPrivate)
+	    VERMILIONPTR(pScrn)->pScrn = pScrn;
+    }
 
     return ((VERMILIONPtr) pScrn->driverPrivate);
 }
@@ -434,21 +483,91 @@ VERMILIONPreInitAccel(ScrnInfoPtr pScrn)
 {
     VERMILIONPtr pVermilion = VERMILIONGetRec(pScrn);
     MessageType from;
+    const char *method;
 
     from =
 	xf86GetOptValBool(pVermilion->Options, OPTION_ACCEL,
 	&pVermilion->accelOn)
 	? X_CONFIG : X_DEFAULT;
 
-    if (pVermilion->accelOn) {
+    xf86DrvMsg(pScrn->scrnIndex, from, "Acceleration %sabled\n",
+	pVermilion->accelOn ? "en" : "dis");
+
+    pVermilion->useEXA = FALSE;
+
+    /*
+     * Without the MBX, depth 15 still uses XAA to write spans with the
+     * alpha bit set instead of going through the wfb accessors.
+     */
+    if (!pVermilion->accelOn) {
+	if (pScrn->depth != 15)
+	    return TRUE;
 	if (!xf86LoadSubModule(pScrn, "xaa"))
 	    return FALSE;
 
+#ifdef VERMILION_SYMLISTS
 	xf86LoaderReqSymLists(xaaSymbols, NULL);
+#endif
+	return TRUE;
     }
 
-    xf86DrvMsg(pScrn->scrnIndex, from, "Acceleration %sabled\n",
-	pVermilion->accelOn ? "en" : "dis");
+    from = X_DEFAULT;
+    method = xf86GetOptValString(pVermilion->Options, OPTION_ACCEL_METHOD);
+    if (method) {
+	from = X_CONFIG;
+	if (!xf86NameCmp(method, "EXA")) {
+	    pVermilion->useEXA = TRUE;
+	} else if (xf86NameCmp(method, "XAA")) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Unknown AccelMethod \"%s\"\n", method);
+	    from = X_DEFAULT;
+	}
+    }
+
+    /* fb fallbacks inside EXA don't know about the depth 15 alpha bit. */
+    if (pVermilion->useEXA && pScrn->depth == 15) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+	    "EXA is not supported at depth 15\n");
+	pVermilion->useEXA = FALSE;
+	from = X_DEFAULT;
+    }
+
+    if (pVermilion->useEXA) {
+	if (!xf86LoadSubModule(pScrn, "exa"))
+	    return FALSE;
+
+#ifdef VERMILION_SYMLISTS
+	xf86LoaderReqSymLists(exaSymbols, NULL);
+#endif
+    } else {
+	if (!xf86LoadSubModule(pScrn, "xaa"))
+	    return FALSE;
+
+#ifdef VERMILION_SYMLISTS
+	xf86LoaderReqSymLists(xaaSymbols, NULL);
+#endif
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, from, "Using %s acceleration\n",
+	pVermilion->useEXA ? "EXA" : "XAA");
+
+    /* VERMILIONMBXCalibrate() measures it unless it's set here. */
+    pVermilion->cpuThreshold = -1;
+    if (xf86GetOptValInteger(pVermilion->Options, OPTION_CPU_THRESHOLD,
+	    &pVermilion->cpuThreshold) && pVermilion->cpuThreshold < 0) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+	    "Ignoring negative CPUThreshold\n");
+	pVermilion->cpuThreshold = -1;
+    }
+
+    pVermilion->accelThread = FALSE;
+    from =
+	xf86GetOptValBool(pVermilion->Options, OPTION_ACCEL_THREAD,
+	&pVermilion->accelThread)
+	? X_CONFIG : X_DEFAULT;
+
+    xf86DrvMsg(pScrn->scrnIndex, from, "MBX submission thread %sabled\n",
+	pVermilion->accelThread ? "en" : "dis");
 
     return TRUE;
 }
@@ -468,15 +587,130 @@ VERMILIONPreInitShadowFB(ScrnInfoPtr pScrn)
 	if (!xf86LoadSubModule(pScrn, "shadow"))
 	    return FALSE;
 
+#ifdef VERMILION_SYMLISTS
 	xf86LoaderReqSymLists(shadowSymbols, NULL);
+#endif
     }
 
     xf86DrvMsg(pScrn->scrnIndex, from, "Shadow framebuffer %sabled\n",
 	pVermilion->shadowFB ? "en" : "dis");
 
+    if (!pVermilion->shadowFB)
+	return TRUE;
+
+    pVermilion->shadowStreaming = FALSE;
+    from =
+	xf86GetOptValBool(pVermilion->Options, OPTION_SHADOW_STREAMING,
+	&pVermilion->shadowStreaming)
+	? X_CONFIG : X_DEFAULT;
+
+    xf86DrvMsg(pScrn->scrnIndex, from,
+	"Shadow framebuffer streaming stores %sabled\n",
+	pVermilion->shadowStreaming ? "en" : "dis");
+
+    pVermilion->shadowCoalesce = VERMILION_DEFAULT_SHADOW_COALESCE;
+    from = xf86GetOptValInteger(pVermilion->Options, OPTION_SHADOW_COALESCE,
+	&pVermilion->shadowCoalesce)
+	? X_CONFIG : X_DEFAULT;
+
+    if (pVermilion->shadowCoalesce > 0) {
+	xf86DrvMsg(pScrn->scrnIndex, from,
+	    "Coalescing shadow damage at %d pixels per scanline\n",
+	    pVermilion->shadowCoalesce);
+    } else {
+	xf86DrvMsg(pScrn->scrnIndex, from,
+	    "Shadow damage coalescing disabled\n");
+    }
+
+    pVermilion->shadowTileHash = FALSE;
+    from =
+	xf86GetOptValBool(pVermilion->Options, OPTION_SHADOW_TILEHASH,
+	&pVermilion->shadowTileHash)
+	? X_CONFIG : X_DEFAULT;
+
+    xf86DrvMsg(pScrn->scrnIndex, from,
+	"Shadow framebuffer tile change detection %sabled\n",
+	pVermilion->shadowTileHash ? "en" : "dis");
+
+    pVermilion->shadowThreads = 1;
+    from = xf86GetOptValInteger(pVermilion->Options, OPTION_SHADOW_THREADS,
+	&pVermilion->shadowThreads)
+	? X_CONFIG : X_DEFAULT;
+
+    if (pVermilion->shadowThreads < 1 ||
+	pVermilion->shadowThreads > VERMILION_MAX_SHADOW_THREADS) {
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+	    "Invalid shadow thread count %d\n", pVermilion->shadowThreads);
+	return FALSE;
+    }
+    xf86DrvMsg(pScrn->scrnIndex, from, "Using %d shadow upload thread%s\n",
+	pVermilion->shadowThreads, pVermilion->shadowThreads > 1 ? "s" : "");
+
+    pVermilion->shadowAsync = FALSE;
+    from =
+	xf86GetOptValBool(pVermilion->Options, OPTION_SHADOW_ASYNC,
+	&pVermilion->shadowAsync)
+	? X_CONFIG : X_DEFAULT;
+
+    xf86DrvMsg(pScrn->scrnIndex, from,
+	"Asynchronous shadow framebuffer upload %sabled\n",
+	pVermilion->shadowAsync ? "en" : "dis");
+
+    /*
+     * The flusher thread would hash and copy the shadow while the server
+     * keeps drawing into it, so a tile could be hashed with pixels that
+     * never reach the framebuffer and then skipped as unchanged.
+     */
+    if (pVermilion->shadowAsync && pVermilion->shadowTileHash) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+	    "ShadowTileHash can't be used with ShadowAsync, disabling "
+	    "tile change detection\n");
+	pVermilion->shadowTileHash = FALSE;
+    }
+
+    pVermilion->shadowMBX = FALSE;
+    from =
+	xf86GetOptValBool(pVermilion->Options, OPTION_SHADOW_MBX,
+	&pVermilion->shadowMBX)
+	? X_CONFIG : X_DEFAULT;
+
+    xf86DrvMsg(pScrn->scrnIndex, from,
+	"MBX placement of shadow framebuffer updates %sabled\n",
+	pVermilion->shadowMBX ? "en" : "dis");
+
     return TRUE;
 }
 
+static int
+VERMILIONIoctl(void *closure, unsigned long request, void *arg)
+{
+    ScrnInfoPtr pScrn = closure;
+
+    return ioctl(VERMILIONPTR(pScrn)->fbFD, request, arg);
+}
+
+static void
+VERMILIONQueryVRAMChunks(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONVRAMChunkPtr chunk;
+    int err, i;
+
+    pVermilion->numVRAMChunks = VERMILIONVRAMQueryChunks(VERMILIONIoctl,
+	pScrn, pVermilion->vramChunks, &err);
+    if (err)
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+	    "Failed to query VRAM chunk %d: %s.\n",
+	    pVermilion->numVRAMChunks + 1, strerror(err));
+
+    for (i = 0; i < pVermilion->numVRAMChunks; i++) {
+	chunk = &pVermilion->vramChunks[i];
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "VRAM chunk %d: %lu kB at 0x%08lx.\n", i + 1,
+	    chunk->size / 1024, (unsigned long)chunk->devAddr);
+    }
+}
+
 static int
 VERMILIONAllocInstance(ScrnInfoPtr pScrn)
 {
@@ -502,6 +736,8 @@ VERMILIONAllocInstance(ScrnInfoPtr pScrn)
 	pVermilion->kernelmbx = pciTag(rep->gpu_tag.bus,
 	    rep->gpu_tag.slot, rep->gpu_tag.function);
 	ErrorF("AllocInstance 0x%08lx %ld\n", pScrn->memPhysBase, pVermilion->fbSize);
+	if (rep->vram_total_size > rep->vram_contig_size)
+	    VERMILIONQueryVRAMChunks(pScrn);
     }
 
     return ret;
@@ -525,7 +761,7 @@ VERMILIONPreInit(ScrnInfoPtr pScrn, int flags)
     int mbxCount;
     MessageType from;
     unsigned ssVendor, ssDevice;
-    const char *ssName, *fbmod, **fbsym;
+    const char *ssName, *fbmod;
 
     ClockRangePtr clockRanges;
 
@@ -610,17 +846,18 @@ VERMILIONPreInit(ScrnInfoPtr pScrn, int flags)
 
     if (pScrn->depth == 15) {
 	fbmod = "wfb";
-	fbsym = wfbSymbols;
     } else {
 	fbmod = "fb";
-	fbsym = fbSymbols;
     }
 
     /* Load (w)fb module */
     if (!xf86LoadSubModule(pScrn, fbmod))
 	return (FALSE);
 
-    xf86LoaderReqSymLists(fbsym, NULL);
+#ifdef VERMILION_SYMLISTS
+    xf86LoaderReqSymLists(pScrn->depth == 15 ? wfbSymbols : fbSymbols,
+	NULL);
+#endif
 
     pScrn->chipset = "vermilion";
     pScrn->monitor = pScrn->confScreen->monitor;
@@ -781,141 +1018,6 @@ VERMILIONPreInit(ScrnInfoPtr pScrn, int flags)
     return (TRUE);
 }
 
-void
-VERMILIONUpdatePackedDepth15(ScreenPtr pScreen, shadowBufPtr pBuf)
-{
-    RegionPtr damage = &pBuf->damage;
-    PixmapPtr pShadow = pBuf->pPixmap;
-    int nbox = REGION_NUM_RECTS(damage);
-    BoxPtr pbox = REGION_RECTS(damage);
-    FbBits *shaBase, *shaLine, *sha;
-    FbStride shaStride;
-    int scrBase, scrLine, scr;
-    int shaBpp;
-    int shaXoff, shaYoff;	       /* XXX assumed to be zero */
-    int x, y, w, h, width;
-    int i;
-    FbBits *winBase = NULL, *win;
-    CARD32 winSize;
-
-    fbGetDrawable(&pShadow->drawable, shaBase, shaStride, shaBpp, shaXoff,
-	shaYoff);
-    while (nbox--) {
-	x = pbox->x1 * shaBpp;
-	y = pbox->y1;
-	w = (pbox->x2 - pbox->x1) * shaBpp;
-	h = pbox->y2 - pbox->y1;
-
-	scrLine = (x >> FB_SHIFT);
-	shaLine = shaBase + y * shaStride + (x >> FB_SHIFT);
-
-	x &= FB_MASK;
-	w = (w + x + FB_MASK) >> FB_SHIFT;
-
-	while (h--) {
-	    winSize = 0;
-	    scrBase = 0;
-	    width = w;
-	    scr = scrLine;
-	    sha = shaLine;
-	    while (width) {
-		/* how much remains in this window */
-		i = scrBase + winSize - scr;
-		if (i <= 0 || scr < scrBase) {
-		    winBase = (FbBits *) (*pBuf->window) (pScreen,
-			y,
-			scr * sizeof(FbBits),
-			SHADOW_WINDOW_WRITE, &winSize, pBuf->closure);
-		    if (!winBase)
-			return;
-		    scrBase = scr;
-		    winSize /= sizeof(FbBits);
-		    i = winSize;
-		}
-		win = winBase + (scr - scrBase);
-		if (i > width)
-		    i = width;
-		width -= i;
-		scr += i;
-		/* Here we set the high bit on upload for depth 15 because
-		 * the hardware requires it. - AlanH.
-		 */
-		while (i--)
-		    *win++ = 0x80008000 | *sha++;
-	    }
-	    shaLine += shaStride;
-	    y++;
-	}
-	pbox++;
-    }
-}
-
-void
-VERMILIONUpdatePackedDepth24(ScreenPtr pScreen, shadowBufPtr pBuf)
-{
-    RegionPtr damage = &pBuf->damage;
-    PixmapPtr pShadow = pBuf->pPixmap;
-    int nbox = REGION_NUM_RECTS(damage);
-    BoxPtr pbox = REGION_RECTS(damage);
-    FbBits *shaBase, *shaLine, *sha;
-    FbStride shaStride;
-    int scrBase, scrLine, scr;
-    int shaBpp;
-    int shaXoff, shaYoff;	       /* XXX assumed to be zero */
-    int x, y, w, h, width;
-    int i;
-    FbBits *winBase = NULL, *win;
-    CARD32 winSize;
-
-    fbGetDrawable(&pShadow->drawable, shaBase, shaStride, shaBpp, shaXoff,
-	shaYoff);
-    while (nbox--) {
-	x = pbox->x1 * shaBpp;
-	y = pbox->y1;
-	w = (pbox->x2 - pbox->x1) * shaBpp;
-	h = pbox->y2 - pbox->y1;
-
-	scrLine = (x >> FB_SHIFT);
-	shaLine = shaBase + y * shaStride + (x >> FB_SHIFT);
-
-	x &= FB_MASK;
-	w = (w + x + FB_MASK) >> FB_SHIFT;
-
-	while (h--) {
-	    winSize = 0;
-	    scrBase = 0;
-	    width = w;
-	    scr = scrLine;
-	    sha = shaLine;
-	    while (width) {
-		/* how much remains in this window */
-		i = scrBase + winSize - scr;
-		if (i <= 0 || scr < scrBase) {
-		    winBase = (FbBits *) (*pBuf->window) (pScreen,
-			y,
-			scr * sizeof(FbBits),
-			SHADOW_WINDOW_WRITE, &winSize, pBuf->closure);
-		    if (!winBase)
-			return;
-		    scrBase = scr;
-		    winSize /= sizeof(FbBits);
-		    i = winSize;
-		}
-		win = winBase + (scr - scrBase);
-		if (i > width)
-		    i = width;
-		width -= i;
-		scr += i;
-		while (i--)
-		    *win++ = *sha++;
-	    }
-	    shaLine += shaStride;
-	    y++;
-	}
-	pbox++;
-    }
-}
-
 static void *
 VERMILIONWindowLinear(ScreenPtr pScreen, CARD32 row, CARD32 offset, int mode,
     CARD32 * size, void *closure)
@@ -931,45 +1033,6 @@ VERMILIONWindowLinear(ScreenPtr pScreen, CARD32 row, CARD32 offset, int mode,
     return ((CARD8 *) pVermilion->fbMap + row * (*size) + offset);
 }
 
-#if X_BYTE_ORDER == X_BIG_ENDIAN
-#error VERMILIONReadMemory and VERMILIONWriteMemory only work on little endian
-#endif
-
-static FbBits
-VERMILIONReadMemory(const void *src, int size)
-{
-    FbBits bits = 0;
-
-    memcpy(&bits, src, size);
-
-    return bits;
-}
-
-static void
-VERMILIONWriteMemoryPassthru(void *dst, FbBits value, int size)
-{
-    memcpy(dst, &value, size);
-}
-
-static void
-VERMILIONWriteMemorySetAlpha(void *dst, FbBits value, int size)
-{
-    switch (size) {
-    case 4:
-	value |= 0x80008000;
-	break;
-    case 3:
-    case 2:
-	value |= 0x8000;
-    case 1:
-	break;
-    default:
-	FatalError("Unsupported size %d in %s", size, __func__);
-    }
-
-    memcpy(dst, &value, size);
-}
-
 static void
 VERMILIONSetupWrap(ReadMemoryProcPtr *pRead, WriteMemoryProcPtr *pWrite,
 			DrawablePtr pDraw)
@@ -1000,6 +1063,32 @@ VERMILIONFinishWrap(DrawablePtr pDraw)
 {
 }
 
+/*
+ * Don't let MBX commands sit in the command buffer while the server
+ * waits for clients. With ShadowMBX and ShadowAsync the flusher thread
+ * owns the command buffer, and VERMILIONShadowStageSubmit() flushes it
+ * there.
+ */
+
+static void
+VERMILIONBlockHandler(int scrnIndex, pointer blockData, pointer pTimeout,
+    pointer pReadmask)
+{
+    ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
+    ScreenPtr pScreen = pScrn->pScreen;
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pScreen->BlockHandler = pVermilion->BlockHandler;
+    (*pScreen->BlockHandler) (scrnIndex, blockData, pTimeout, pReadmask);
+    pScreen->BlockHandler = VERMILIONBlockHandler;
+
+    if (pScrn->vtSema &&
+	!(pVermilion->shadowAsyncRec && pVermilion->shadowStage))
+	VERMILIONMBXFlush(pScrn);
+
+    VERMILIONWaitCheck(pScrn);
+}
+
 static Bool
 VERMILIONScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 {
@@ -1106,6 +1195,9 @@ VERMILIONScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     else
     	fbPictureInit(pScreen, 0, 0);
 
+    if (pVermilion->shadowFB)
+	VERMILIONShadowInit(pScrn);
+
     if (pVermilion->shadowFB &&
 	(!shadowSetup(pScreen) || !shadowAdd(pScreen, NULL,
 		pScrn->depth ==
@@ -1123,11 +1215,19 @@ VERMILIONScreenInit(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 
     /* Enable acceleration */
     if (!pVermilion->shadowFB && pVermilion->accelOn) {
-	if (!VERMILIONAccelInit(pScreen)) {
+	if (!(pVermilion->useEXA ? VERMILIONExaInit(pScreen) :
+		VERMILIONAccelInit(pScreen))) {
 	    xf86DrvMsg(scrnIndex, X_ERROR,
 		"Acceleration initialization failed\n");
 	    pVermilion->accelOn = FALSE;
+	} else {
+	    pVermilion->BlockHandler = pScreen->BlockHandler;
+	    pScreen->BlockHandler = VERMILIONBlockHandler;
 	}
+    } else if (!pVermilion->shadowFB && pScrn->depth == 15) {
+	if (!VERMILIONAccelInitCPU15(pScreen))
+	    xf86DrvMsg(scrnIndex, X_WARNING,
+		"Falling back to wfb for depth 15 rendering\n");
     }
 
     /* software cursor */
@@ -1172,6 +1272,12 @@ VERMILIONEnterVT(int scrnIndex, int flags)
 	sys->panelOn(sys);
     }
 
+    VERMILIONMBXReset(pScrn);
+
+    /* LeaveVT cleared the framebuffer behind the tile hashes' back. */
+    if (pVermilion->shadowFB)
+	VERMILIONShadowInvalidate(pScrn);
+
     return TRUE;
 }
 
@@ -1181,8 +1287,10 @@ VERMILIONLeaveVT(int scrnIndex, int flags)
     ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
 
-    if (pVermilion->accel)
-	(*pVermilion->accel->Sync) (pScrn);
+    VERMILIONAccelSync(pScrn);
+
+    if (pVermilion->shadowFB)
+	VERMILIONShadowSync(pScrn);
 
     /* clear the framebuffer when we switch */
     memset(pVermilion->fbMap, 0, pScrn->virtualY * pVermilion->stride);
@@ -1199,12 +1307,18 @@ VERMILIONCloseScreen(int scrnIndex, ScreenPtr pScreen)
     ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
 
-    if (pVermilion->accel) {
-	(*pVermilion->accel->Sync) (pScrn);
-	XAADestroyInfoRec(pVermilion->accel);
-	pVermilion->accel = NULL;
+    if (pVermilion->BlockHandler) {
+	pScreen->BlockHandler = pVermilion->BlockHandler;
+	pVermilion->BlockHandler = NULL;
     }
 
+    VERMILIONAccelFini(pScreen);
+
+    if (pVermilion->shadowFB)
+	VERMILIONShadowFini(pScrn);
+
+    VERMILIONMBXFini(pScrn);
+
     if (pScrn->vtSema) {
 	VERMILIONDisablePipe(pScrn);
 	VERMILIONRestore(pScrn);
@@ -1212,6 +1326,9 @@ VERMILIONCloseScreen(int scrnIndex, ScreenPtr pScreen)
     }
     pScrn->vtSema = FALSE;
 
+    /* After the pad waits in VERMILIONDisablePipe() */
+    VERMILIONWaitReport(pScrn);
+
     pScreen->CloseScreen = pVermilion->CloseScreen;
     return pScreen->CloseScreen(scrnIndex, pScreen);
 }
@@ -1220,12 +1337,11 @@ static Bool
 VERMILIONSwitchMode(int scrnIndex, DisplayModePtr pMode, int flags)
 {
     ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
-    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
 
-    if (pVermilion->accel)
-	(*pVermilion->accel->Sync) (pScrn);
+    VERMILIONAccelSync(pScrn);
+    VERMILIONMBXInvalidateState(pScrn);
 
-    return VERMILIONSetMode(xf86Screens[scrnIndex], pMode);
+    return VERMILIONSetMode(pScrn, pMode);
 }
 
 /* Set a graphics mode */
@@ -1257,6 +1373,8 @@ static Bool
 VERMILIONMapMem(ScrnInfoPtr pScrn)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONVRAMChunkPtr chunk;
+    int i;
 
     if (pVermilion->fbMap != NULL)
 	return (TRUE);
@@ -1272,6 +1390,19 @@ VERMILIONMapMem(ScrnInfoPtr pScrn)
 	return FALSE;
     }
 
+    /* The rest of VRAM is only a bonus for pixmaps */
+    for (i = 0; i < pVermilion->numVRAMChunks; i++) {
+	chunk = &pVermilion->vramChunks[i];
+	chunk->map = mmap(NULL, chunk->size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, pVermilion->fbFD, chunk->mmapOffset);
+	if (chunk->map == MAP_FAILED) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Failed to map VRAM chunk %d: %s.\n", i + 1,
+		strerror(errno));
+	    chunk->map = NULL;
+	}
+    }
+
     pVermilion->mbxSize = 1 << pVermilion->mbx->size[0];
     pVermilion->mbxRegsBase = VERMILIONMapPciVideo(pScrn, "MBX",
 	pciTag(pVermilion->mbx->bus,
@@ -1303,12 +1434,22 @@ static void
 VERMILIONUnmapMem(ScrnInfoPtr pScrn)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONVRAMChunkPtr chunk;
+    int i;
 
     if (pVermilion->fbMap != NULL) {
 	munmap(pVermilion->fbMap, pVermilion->fbSize);
 	pVermilion->fbMap = NULL;
     }
 
+    for (i = 0; i < pVermilion->numVRAMChunks; i++) {
+	chunk = &pVermilion->vramChunks[i];
+	if (chunk->map != NULL) {
+	    munmap(chunk->map, chunk->size);
+	    chunk->map = NULL;
+	}
+    }
+
     if (pVermilion->mbxRegsBase != NULL) {
 	xf86UnMapVidMem(pScrn->scrnIndex, pVermilion->mbxRegsBase,
 	    pVermilion->mbxSize);
@@ -37,6 +37,8 @@
 #ifndef _VERMILION_H_
 #define _VERMILION_H_
 
+#include <pthread.h>
+
 /* All drivers should typically include these */
 #include "xf86.h"
 #include "xf86_OSproc.h"
@@ -76,7 +78,11 @@
 #define wfbPictureInit fbPictureInit
 
 #include "xaa.h"
+#include "exa.h"
 #include "vermilion_sys.h"
+#include "vermilion_heap.h"
+#include "vermilion_vram.h"
+#include "vermilion_kernels.h"
 
 #define VERMILION_VERSION		4000
 #define VERMILION_NAME		"VERMILION"
@@ -85,8 +91,102 @@
 #define VERMILION_MINOR_VERSION	0
 #define VERMILION_PATCHLEVEL	1
 
+typedef struct _VERMILIONShadowStats
+{
+    unsigned long flushes;
+    unsigned long long bytes;
+    unsigned long long usecs;
+    unsigned long long boxesIn;
+    unsigned long long boxesOut;
+    unsigned long long tilesChecked;
+    unsigned long long tilesSkipped;
+    unsigned long updates;
+    unsigned long long stallUsecs;     /* server thread time in updates */
+    unsigned long latencyCount;
+    unsigned long long latencyUsecs;   /* damage to framebuffer */
+} VERMILIONShadowStatsRec, *VERMILIONShadowStatsPtr;
+
+typedef struct _VERMILIONShadowPool *VERMILIONShadowPoolPtr;
+typedef struct _VERMILIONShadowAsync *VERMILIONShadowAsyncPtr;
+typedef struct _VERMILIONSubmit *VERMILIONSubmitPtr;
+
+/*
+ * Dwords of MBX commands collected before they're written to the slave
+ * port, see vermilion_mbx.h.
+ */
+#define VERMILION_CMD_BUF_SIZE 1024
+
+/*
+ * Colour expansion source palettes in VRAM, and dwords in one scanline of
+ * host data: up to 4096 pixels at 32 bpp plus the left edge skip.
+ */
+#define VERMILION_PAL_SLOTS 16
+#define VERMILION_HOST_DWORDS 4100
+
+/*
+ * Mono 8x8 patterns expanded into VRAM for the MBX pattern unit, keyed by
+ * their bits and colours.
+ */
+#define VERMILION_PAT_SLOTS 8
+
+typedef struct _VERMILIONPattern
+{
+    CARD32 bits[2];
+    CARD32 fg;
+    CARD32 bg;
+    CARD32 seq;			       /* last blit to read it */
+    Bool valid;
+} VERMILIONPatternRec, *VERMILIONPatternPtr;
+
+/*
+ * Last MBX sequence numbers to read and write an EXA pixmap, or a band of
+ * framebuffer rows with XAA.
+ */
+#define VERMILION_SURFACE_BITS 8
+#define VERMILION_NUM_SURFACES (1 << VERMILION_SURFACE_BITS)
+
+typedef struct _VERMILIONSurface
+{
+    unsigned long offset;
+    CARD32 lastRead;
+    CARD32 lastWrite;
+    Bool valid;
+} VERMILIONSurfaceRec, *VERMILIONSurfacePtr;
+
+/*
+ * Places the driver waits for the hardware, see vermilion_wait.c.
+ */
+typedef enum
+{
+    VERMILION_WAIT_FIFO,
+    VERMILION_WAIT_SEQ,
+    VERMILION_WAIT_RING,
+    VERMILION_WAIT_PAD_OFF,
+    VERMILION_WAIT_PAD_ON,
+    VERMILION_NUM_WAITS
+} VERMILIONWaitSite;
+
+#define VERMILION_WAIT_BUCKETS 21
+
+typedef struct _VERMILIONWaitStats
+{
+    unsigned long count;
+    unsigned long timeouts;
+    unsigned long long usecs;
+    unsigned long hist[VERMILION_WAIT_BUCKETS];	/* < 1 us, < 2 us, ... */
+} VERMILIONWaitStatsRec, *VERMILIONWaitStatsPtr;
+
+typedef Bool (*VERMILIONWaitProc) (ScrnInfoPtr pScrn, void *arg);
+
+typedef struct _VERMILIONTile
+{
+    unsigned long long hash;
+    CARD32 flags;
+} VERMILIONTileRec, *VERMILIONTilePtr;
+
  /*XXX*/ typedef struct _VERMILIONRec
 {
+    ScrnInfoPtr pScrn;
     EntityInfoPtr pEnt;
     GDevPtr device;
     pciVideoPtr pciInfo;
@@ -106,6 +206,8 @@
     CARD32 *vdcRegsBase;
     CARD32 *mbxRegsBase;
     unsigned long fbSize;
+    VERMILIONVRAMChunkRec vramChunks[VERMILION_MAX_VRAM_CHUNKS];
+    int numVRAMChunks;
     unsigned long mbxSize;
     unsigned long vdcSize;
     unsigned long mchSize;
@@ -137,13 +239,76 @@
  * Acceleration
  */
     Bool accelOn;
+    Bool useEXA;
     XAAInfoRecPtr accel;
+    ExaDriverPtr exa;
+    VERMILIONPoolRec pools[VERMILION_MAX_POOLS];   /* EXA pixmap heaps */
+    int numPools;
+    VERMILIONSurfaceRec surfaces[VERMILION_NUM_SURFACES];
+    CARD32 surfaceFloor;
+    VERMILIONSurfacePtr exaSrc;
+    VERMILIONSurfacePtr exaDst;
+    PixmapPtr exaSrcPixmap;
+    int cpuThreshold;		       /* CPUThreshold option, -1 if unset */
+    int cpuFillMax;		       /* pixels */
+    int cpuCopyMax;
+    Bool cpuOK;			       /* current op can be done by the CPU */
+    unsigned long cpuFills;
+    unsigned long cpuCopies;
+    int cpuYDir;		       /* depth 15 CPU hooks without the MBX */
+    int cpuX;
+    int cpuY;
+    int cpuW;
+    int cpuSkip;
+    int cpuFg;
+    int cpuBg;
     CARD32 mbxBpp;
     CARD32 mbxFBDevAddr;
     CARD32 *slavePort;
     CARD32 FifoSlots;
+    CARD32 cmdBuf[VERMILION_CMD_BUF_SIZE];
+    CARD32 cmdCount;
+    unsigned long long cmdDwords;
+    unsigned long cmdBursts;
+    unsigned long cmdStatusReads;
+    unsigned long long cmdSaved;       /* dropped by the state cache */
+    CARD32 mbxStateValid;
+    CARD32 mbxSrcCtrl;
+    CARD32 mbxSrcAddr;
+    CARD32 mbxDstCtrl;
+    CARD32 mbxDstAddr;
+    CARD32 mbxColorKey;
+    CARD32 mbxColorKeyMask;
+    CARD32 mbxPatCtrl;
+    CARD32 mbxPatAddr;
+    ScreenBlockHandlerProcPtr BlockHandler;
+    Bool accelThread;
+    VERMILIONSubmitPtr mbxSubmit;
     volatile CARD32 *mbxSyncMap;
     CARD32 mbxSyncDevAddr;
+    CARD32 mbxSeqEmitted;
+    CARD32 mbxSeqRetired;
+    Bool mbxDirty;		       /* commands queued since last fence */
+    unsigned long mbxWaits;
+    unsigned long mbxWaitsIdle;
+    CARD32 hostScanline[VERMILION_HOST_DWORDS];
+    unsigned char *hostBuffers[1];
+    CARD32 hostDwords;
+    int hostLines;
+    CARD32 hostOwed;		       /* host data still to queue */
+    CARD32 cmdOwed;		       /* hostOwed at the start of cmdBuf */
+    Bool palValid;
+    int palSlot;
+    CARD32 palFg;
+    CARD32 palBg;
+    CARD32 palSeq[VERMILION_PAL_SLOTS];
+    VERMILIONPatternRec patterns[VERMILION_PAT_SLOTS];
+    int patNext;
+    VERMILIONPatternPtr pattern;       /* NULL for a cached colour pattern */
+    CARD32 patAddr;
+    CARD32 patPitch;
+    unsigned long patHits;
+    unsigned long patMisses;
     CARD32 ROP;
     CARD32 transEnable;
     CARD32 fillColour;
@@ -154,6 +319,30 @@
  */
     char *shadowmem;
     Bool shadowFB;
+    VERMILIONCopyRowProc shadowCopyRow;
+    Bool shadowStreaming;
+    void (*shadowFence) (void);
+    VERMILIONShadowStatsRec shadowStats;
+    int shadowCoalesce;
+    BoxPtr shadowBoxes;
+    int shadowBoxesSize;
+    Bool shadowTileHash;
+    VERMILIONTilePtr shadowTiles;
+    int shadowTilesX;
+    int shadowTilesY;
+    BoxPtr shadowTileBoxes;
+    int shadowThreads;
+    VERMILIONShadowPoolPtr shadowPool;
+    Bool shadowAsync;
+    VERMILIONShadowAsyncPtr shadowAsyncRec;
+    Bool shadowMBX;
+    VERMILIONShadowStagePtr shadowStage;
+
+/*
+ * Hardware waits
+ */
+    VERMILIONWaitStatsRec waitStats[VERMILION_NUM_WAITS];
+    volatile int waitLost[VERMILION_NUM_WAITS];	/* helper thread timeouts */
 
 /*
  * Debug modesetting
@@ -187,7 +376,46 @@ typedef struct _VERMILIONPanelRec
  * vermilion_accel.c
  */
 
+extern Bool VERMILIONMBXInit(ScrnInfoPtr pScrn);
+extern void VERMILIONMBXFini(ScrnInfoPtr pScrn);
 extern Bool VERMILIONAccelInit(ScreenPtr pScreen);
+extern Bool VERMILIONAccelInitCPU15(ScreenPtr pScreen);
+extern void VERMILIONAccelSync(ScrnInfoPtr pScrn);
+extern void VERMILIONAccelFini(ScreenPtr pScreen);
+extern void VERMILIONMBXSync(ScrnInfoPtr pScrn);
+extern CARD32 VERMILIONMBXEmitSeq(ScrnInfoPtr pScrn);
+extern CARD32 VERMILIONMBXPendingSeq(ScrnInfoPtr pScrn);
+extern Bool VERMILIONMBXSeqRetired(ScrnInfoPtr pScrn, CARD32 seq);
+extern VERMILIONSurfacePtr VERMILIONMBXSurfaceSlot(VERMILIONPtr pVermilion,
+    unsigned long offset);
+extern void VERMILIONMBXSurfaceRetire(VERMILIONPtr pVermilion,
+    VERMILIONSurfacePtr surf);
+extern VERMILIONSurfacePtr VERMILIONMBXSurface(VERMILIONPtr pVermilion,
+    unsigned long offset);
+extern void VERMILIONMBXWaitSeq(ScrnInfoPtr pScrn, CARD32 seq);
+extern void VERMILIONMBXReset(ScrnInfoPtr pScrn);
+extern void VERMILIONMBXInvalidateState(ScrnInfoPtr pScrn);
+extern void VERMILIONMBXCalibrate(ScrnInfoPtr pScrn);
+extern void VERMILIONCPUFill(ScrnInfoPtr pScrn, CARD8 *base, int pitch,
+    int x, int y, int w, int h, CARD32 colour);
+extern void VERMILIONCPUCopy(ScrnInfoPtr pScrn, CARD8 *srcBase,
+    int srcPitch, CARD8 *dstBase, int dstPitch, int srcX, int srcY,
+    int dstX, int dstY, int w, int h, int ydir);
+extern void VERMILIONMBXFlush(ScrnInfoPtr pScrn);
+extern Bool VERMILIONMBXWaitFifo(VERMILIONPtr pVermilion, CARD32 n);
+extern void VERMILIONMBXReport(ScrnInfoPtr pScrn);
+extern void VERMILIONMBXFence(ScrnInfoPtr pScrn, CARD32 devAddr, CARD32 val);
+extern void VERMILIONMBXUpload(ScrnInfoPtr pScrn, CARD32 srcAddr,
+    int srcPitch, int x, int y, int w, int h);
+extern void VERMILIONMBXWriteImage(ScrnInfoPtr pScrn, CARD32 dstAddr,
+    int dstPitch, int x, int y, int w, int h, const CARD8 *src,
+    int srcPitch);
+
+/*
+ * vermilion_exa.c
+ */
+
+extern Bool VERMILIONExaInit(ScreenPtr pScreen);
 
 /*
  * vermilion_mode.c
@@ -205,6 +433,44 @@ extern int VERMILIONDimScreen(ScrnInfoPtr pScrn, CARD8 level);
 extern void VERMILIONDisablePipe(ScrnInfoPtr pScrn);
 void VERMILIONWaitForVblank(ScrnInfoPtr pScrn);
 
+/*
+ * vermilion_shadow.c
+ */
+
+extern void VERMILIONShadowInit(ScrnInfoPtr pScrn);
+extern void VERMILIONShadowFini(ScrnInfoPtr pScrn);
+extern void VERMILIONShadowInvalidate(ScrnInfoPtr pScrn);
+extern void VERMILIONShadowSync(ScrnInfoPtr pScrn);
+extern void VERMILIONUpdatePackedDepth15(ScreenPtr pScreen,
+    shadowBufPtr pBuf);
+extern void VERMILIONUpdatePackedDepth24(ScreenPtr pScreen,
+    shadowBufPtr pBuf);
+
+/*
+ * vermilion_submit.c
+ */
+
+extern VERMILIONSubmitPtr VERMILIONSubmitCreate(ScrnInfoPtr pScrn);
+extern void VERMILIONSubmitDestroy(VERMILIONSubmitPtr submit);
+extern void VERMILIONSubmitDrain(VERMILIONSubmitPtr submit);
+extern void VERMILIONSubmitPush(VERMILIONPtr pVermilion, const CARD32 *cmd,
+    CARD32 n);
+
+/*
+ * vermilion_wait.c
+ */
+
+extern unsigned long long VERMILIONUsecs(void);
+extern Bool VERMILIONWait(ScrnInfoPtr pScrn, VERMILIONWaitSite site,
+    VERMILIONWaitProc done, void *arg);
+extern void VERMILIONWaitReport(ScrnInfoPtr pScrn);
+extern void VERMILIONWaitThreadStats(VERMILIONWaitStatsPtr stats);
+extern void VERMILIONWaitMerge(ScrnInfoPtr pScrn,
+    VERMILIONWaitStatsPtr stats);
+extern void VERMILIONWaitCheck(ScrnInfoPtr pScrn);
+extern int VERMILIONCreateThread(pthread_t *thread, void *(*proc) (void *),
+    void *arg);
+
 /* 
  * vermilion_panels.c
  */
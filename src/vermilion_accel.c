@@ -43,26 +43,62 @@
 
 #include "xaarop.h"
 
-static void mbxSync(ScrnInfoRec * pScrn);
 static void mbxSetupForFillRectSolid(ScrnInfoRec * pScrn, int color,
     int rop, unsigned int planemask);
 static void mbxSubsequentFillRectSolid(ScrnInfoRec * pScrn, int x,
     int y, int w, int h);
+static void mbxSubsequentSolidHorVertLine(ScrnInfoRec * pScrn,
+    int x, int y, int len, int dir);
+static void mbxSubsequentSolidBresenhamLine(ScrnInfoRec * pScrn,
+    int x, int y, int absmaj, int absmin, int err, int len, int octant);
 static void mbxSubsequentScreenToScreenCopy(ScrnInfoRec * pScrn,
     int x1, int y1, int x2, int y2, int w, int h);
 static void mbxSetupForScreenToScreenCopy(ScrnInfoRec * pScrn,
     int xdir, int ydir, int rop,
     unsigned int planemask, int transparency_color);
+static void mbxSetupForScanlineCPUToScreenColorExpandFill(ScrnInfoRec *
+    pScrn, int fg, int bg, int rop, unsigned int planemask);
+static void mbxSubsequentScanlineCPUToScreenColorExpandFill(ScrnInfoRec *
+    pScrn, int x, int y, int w, int h, int skipleft);
+static void mbxSubsequentColorExpandScanline(ScrnInfoRec * pScrn,
+    int bufno);
+static CARD32 mbxPackColour(ScrnInfoPtr pScrn, CARD32 colour);
+static void mbxSetupForMono8x8PatternFill(ScrnInfoRec * pScrn,
+    int patx, int paty, int fg, int bg, int rop, unsigned int planemask);
+static void mbxSetupForColor8x8PatternFill(ScrnInfoRec * pScrn,
+    int patx, int paty, int rop, unsigned int planemask,
+    int transparency_color);
+static void mbxSubsequent8x8PatternFillRect(ScrnInfoRec * pScrn,
+    int patx, int paty, int x, int y, int w, int h);
+static void mbxSetupForScanlineImageWrite(ScrnInfoRec * pScrn, int rop,
+    unsigned int planemask, int transparency_color, int bpp, int depth);
+static void mbxSubsequentScanlineImageWriteRect(ScrnInfoRec * pScrn,
+    int x, int y, int w, int h, int skipleft);
+static void mbxSubsequentImageWriteScanline(ScrnInfoRec * pScrn,
+    int bufno);
+static void mbxWritePixmap15(ScrnInfoRec * pScrn, int x, int y, int w,
+    int h, unsigned char *src, int srcwidth, int rop,
+    unsigned int planemask, int transparency_color, int bpp, int depth);
+static void mbxWriteBitmap15(ScrnInfoRec * pScrn, int x, int y, int w,
+    int h, unsigned char *src, int srcwidth, int skipleft, int fg, int bg,
+    int rop, unsigned int planemask);
+static void cpuWritePixmap15(ScrnInfoRec * pScrn, int x, int y, int w,
+    int h, unsigned char *src, int srcwidth, int rop,
+    unsigned int planemask, int transparency_color, int bpp, int depth);
+static void cpuWriteBitmap15(ScrnInfoRec * pScrn, int x, int y, int w,
+    int h, unsigned char *src, int srcwidth, int skipleft, int fg, int bg,
+    int rop, unsigned int planemask);
 
-#define MBX_SYNC_MAP_SIZE 4
+/*
+ * Set up the MBX state shared by the XAA and EXA hooks and the ShadowMBX
+ * upload.
+ */
 
 Bool
-VERMILIONAccelInit(ScreenPtr pScreen)
+VERMILIONMBXInit(ScrnInfoPtr pScrn)
 {
-    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
-    XAAInfoRecPtr infoPtr;
-    BoxRec AvailFBArea;
+    int i;
 
     switch (pScrn->depth) {
     case 15:
@@ -75,181 +111,1591 @@ VERMILIONAccelInit(ScreenPtr pScreen)
 	return FALSE;
     }
 
+    pVermilion->mbxFBDevAddr = pScrn->memPhysBase;
+
+    /* Reserve the fence slots and palettes at the end of the framebuffer */
+    pVermilion->mbxSyncDevAddr = pVermilion->mbxFBDevAddr +
+	pVermilion->fbSize - MBX_SYNC_MAP_SIZE;
+    pVermilion->mbxSyncMap = (CARD32 *) ((char *)pVermilion->fbMap +
+	pVermilion->fbSize - MBX_SYNC_MAP_SIZE);
+
+    pVermilion->slavePort = (CARD32 *) ((char *)pVermilion->mbxRegsBase +
+	MBX_SP_2D_SYS_PHYS_OFFSET);
+    pVermilion->FifoSlots = 0;
+    pVermilion->cmdCount = 0;
+    pVermilion->hostOwed = 0;
+    pVermilion->cmdOwed = 0;
+    pVermilion->cmdDwords = 0;
+    pVermilion->cmdBursts = 0;
+    pVermilion->cmdStatusReads = 0;
+    pVermilion->cmdSaved = 0;
+    pVermilion->mbxStateValid = 0;
+
+    pVermilion->mbxSeqEmitted = 0;
+    pVermilion->mbxSeqRetired = 0;
+    pVermilion->mbxDirty = FALSE;
+    pVermilion->mbxWaits = 0;
+    pVermilion->mbxWaitsIdle = 0;
+    for (i = 0; i < MBX_FENCE_SLOTS; i++)
+	pVermilion->mbxSyncMap[i] = 0;
+
+    pVermilion->palValid = FALSE;
+    pVermilion->palSlot = 0;
+    for (i = 0; i < VERMILION_PAL_SLOTS; i++)
+	pVermilion->palSeq[i] = 0;
+    for (i = 0; i < VERMILION_PAT_SLOTS; i++)
+	pVermilion->patterns[i].valid = FALSE;
+    pVermilion->patNext = 0;
+    pVermilion->patHits = 0;
+    pVermilion->patMisses = 0;
+    memset(pVermilion->surfaces, 0, sizeof(pVermilion->surfaces));
+    pVermilion->surfaceFloor = 0;
+
+    if (pVermilion->accelThread && !pVermilion->mbxSubmit) {
+	pVermilion->mbxSubmit = VERMILIONSubmitCreate(pScrn);
+	if (!pVermilion->mbxSubmit)
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Failed to start the MBX submission thread\n");
+    }
+
+    return TRUE;
+}
+
+/*
+ * Stop the submission thread once nobody will queue MBX work any more.
+ * Anything still queued after this is written by the server thread. The
+ * statistics are only final once the thread is gone.
+ */
+
+void
+VERMILIONMBXFini(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    if (pVermilion->mbxSubmit) {
+	VERMILIONSubmitDestroy(pVermilion->mbxSubmit);
+	pVermilion->mbxSubmit = NULL;
+    }
+
+    if (pVermilion->mbxSyncMap) {
+	VERMILIONMBXReport(pScrn);
+	pVermilion->mbxSyncMap = NULL;
+    }
+}
+
+Bool
+VERMILIONAccelInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    XAAInfoRecPtr infoPtr;
+    BoxRec AvailFBArea;
+
+    if (!VERMILIONMBXInit(pScrn))
+	return FALSE;
+
     pVermilion->accel = infoPtr = XAACreateInfoRec();
     if (!infoPtr)
 	return FALSE;
 
     infoPtr->Flags = PIXMAP_CACHE | OFFSCREEN_PIXMAPS | LINEAR_FRAMEBUFFER;
 
-    infoPtr->Sync = mbxSync;
+    /* Blit coordinates are 12 bits, see MBXRebaseRow() */
+    infoPtr->maxOffPixWidth = MBX_MAX_COORD;
+    infoPtr->maxOffPixHeight = MBX_MAX_COORD;
+
+    infoPtr->Sync = VERMILIONMBXSync;
 
     infoPtr->SolidFillFlags = NO_PLANEMASK;
     infoPtr->SetupForSolidFill = mbxSetupForFillRectSolid;
     infoPtr->SubsequentSolidFillRect = mbxSubsequentFillRectSolid;
 
+    /* Lines are drawn as solid fills, one per run of pixels. */
+    infoPtr->SolidLineFlags = NO_PLANEMASK;
+    infoPtr->SetupForSolidLine = mbxSetupForFillRectSolid;
+    infoPtr->SubsequentSolidHorVertLine = mbxSubsequentSolidHorVertLine;
+    infoPtr->SubsequentSolidBresenhamLine = mbxSubsequentSolidBresenhamLine;
+
     infoPtr->ScreenToScreenCopyFlags = NO_PLANEMASK;
     infoPtr->SetupForScreenToScreenCopy = mbxSetupForScreenToScreenCopy;
     infoPtr->SubsequentScreenToScreenCopy = mbxSubsequentScreenToScreenCopy;
 
+    /* Core text and stipples, expanded by the MBX from mono host data. */
+    pVermilion->hostBuffers[0] = (unsigned char *)pVermilion->hostScanline;
+    infoPtr->ScanlineCPUToScreenColorExpandFillFlags = NO_PLANEMASK |
+	CPU_TRANSFER_PAD_DWORD | SCANLINE_PAD_DWORD | LEFT_EDGE_CLIPPING;
+    infoPtr->NumScanlineColorExpandBuffers = 1;
+    infoPtr->ScanlineColorExpandBuffers = pVermilion->hostBuffers;
+    infoPtr->SetupForScanlineCPUToScreenColorExpandFill =
+	mbxSetupForScanlineCPUToScreenColorExpandFill;
+    infoPtr->SubsequentScanlineCPUToScreenColorExpandFill =
+	mbxSubsequentScanlineCPUToScreenColorExpandFill;
+    infoPtr->SubsequentColorExpandScanline =
+	mbxSubsequentColorExpandScanline;
+
+    /* Image uploads, streamed through the slave port the same way. */
+    infoPtr->ScanlineImageWriteFlags = NO_PLANEMASK |
+	CPU_TRANSFER_PAD_DWORD | SCANLINE_PAD_DWORD | LEFT_EDGE_CLIPPING;
+    infoPtr->NumScanlineImageWriteBuffers = 1;
+    infoPtr->ScanlineImageWriteBuffers = pVermilion->hostBuffers;
+    infoPtr->SetupForScanlineImageWrite = mbxSetupForScanlineImageWrite;
+    infoPtr->SubsequentScanlineImageWriteRect =
+	mbxSubsequentScanlineImageWriteRect;
+    infoPtr->SubsequentImageWriteScanline = mbxSubsequentImageWriteScanline;
+
+    /*
+     * 8x8 pattern fills. XAA keeps colour patterns in its offscreen
+     * pixmap cache; mono ones are expanded into VRAM here.
+     */
+    infoPtr->Mono8x8PatternFillFlags = NO_PLANEMASK | NO_TRANSPARENCY |
+	HARDWARE_PATTERN_PROGRAMMED_BITS | HARDWARE_PATTERN_PROGRAMMED_ORIGIN;
+    infoPtr->SetupForMono8x8PatternFill = mbxSetupForMono8x8PatternFill;
+    infoPtr->SubsequentMono8x8PatternFillRect =
+	mbxSubsequent8x8PatternFillRect;
+
+    infoPtr->Color8x8PatternFillFlags = NO_PLANEMASK | NO_TRANSPARENCY |
+	HARDWARE_PATTERN_PROGRAMMED_ORIGIN;
+    infoPtr->SetupForColor8x8PatternFill = mbxSetupForColor8x8PatternFill;
+    infoPtr->SubsequentColor8x8PatternFillRect =
+	mbxSubsequent8x8PatternFillRect;
+
+    /*
+     * At depth 15 fb has to go through the wfb accessors to set the alpha
+     * bit, one call per pixel pair. Do image and bitmap uploads here
+     * instead, a scanline at a time.
+     */
+    if (pScrn->depth == 15) {
+	infoPtr->WritePixmapFlags = GXCOPY_ONLY | NO_PLANEMASK |
+	    NO_TRANSPARENCY;
+	infoPtr->WritePixmap = mbxWritePixmap15;
+
+	infoPtr->WriteBitmapFlags = GXCOPY_ONLY | NO_PLANEMASK;
+	infoPtr->WriteBitmap = mbxWriteBitmap15;
+    }
+
     AvailFBArea.x1 = 0;
     AvailFBArea.y1 = 0;
     AvailFBArea.x2 = pScrn->displayWidth;
     AvailFBArea.y2 =
 	(pVermilion->fbSize - MBX_SYNC_MAP_SIZE) / pVermilion->stride;
 
-    if (AvailFBArea.y2 > 4095)
-	AvailFBArea.y2 = 4095;
+    /* Up to 32767, see MBXRebaseRow() for rows past 4095 */
+    if (AvailFBArea.y2 > 32767)
+	AvailFBArea.y2 = 32767;
 
     xf86InitFBManager(pScreen, &AvailFBArea);
 
     if (!XAAInit(pScreen, infoPtr))
 	return FALSE;
 
-    pVermilion->mbxFBDevAddr = pScrn->memPhysBase;
-
-    /* Reserve DWORD at the end of the framebuffer for mbxSync() */
-    pVermilion->mbxSyncDevAddr = pVermilion->mbxFBDevAddr +
-	pVermilion->fbSize - MBX_SYNC_MAP_SIZE;
-    pVermilion->mbxSyncMap = (CARD32 *) ((char *)pVermilion->fbMap +
-	pVermilion->fbSize - MBX_SYNC_MAP_SIZE);
-
-    pVermilion->slavePort = (CARD32 *) ((char *)pVermilion->mbxRegsBase +
-	MBX_SP_2D_SYS_PHYS_OFFSET);
+    VERMILIONMBXCalibrate(pScrn);
 
     return TRUE;
 }
 
-static void
-mbxSync(ScrnInfoRec * pScrn)
+/*
+ * Have the MBX write val to the dword at devAddr once everything queued
+ * before it has completed. Leaves the destination set to devAddr. The
+ * caller is going to wait for it, so the command buffer is flushed.
+ */
+
+void
+VERMILIONMBXFence(ScrnInfoPtr pScrn, CARD32 devAddr, CARD32 val)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
-    unsigned int sync_val;
-    volatile CARD32 *fb_sync_val;
-    CARD32 auBltPacket[7];
+    CARD32 auBltPacket[5];
 
-    fb_sync_val = pVermilion->mbxSyncMap;
-    sync_val = ((*fb_sync_val) + 1) % 65536;
+    MBXSetDstSurface(pVermilion, MBX2D_SRC_8888ARGB, devAddr);
 
-    WAITFIFO(7);
+    WAITFIFO(5);
 
-    auBltPacket[0] = MBX2D_DST_CTRL_BH | MBX2D_SRC_8888ARGB;
-    auBltPacket[1] = pVermilion->mbxSyncDevAddr;
-    auBltPacket[2] = MBX2D_BLIT_BH | ROP_P << 8 | ROP_P;
-    auBltPacket[3] = sync_val;
-    auBltPacket[4] = (0 & 0xffff) << 16 | (0 & 0xffff);
-    auBltPacket[5] = (1 & 0xffff) << 16 | (1 & 0xffff);
-    auBltPacket[6] = MBX2D_FENCE_BH;
+    auBltPacket[0] = MBX2D_BLIT_BH | ROP_P << 8 | ROP_P;
+    auBltPacket[1] = val;
+    auBltPacket[2] = (0 & 0xffff) << 16 | (0 & 0xffff);
+    auBltPacket[3] = (1 & 0xffff) << 16 | (1 & 0xffff);
+    auBltPacket[4] = MBX2D_FENCE_BH;
 
-    WRITESLAVEPORTDATA(7);
+    WRITESLAVEPORTDATA(5);
 
-    while (*fb_sync_val != sync_val) {
-#if 0
-	ErrorF("WAITING 0x%x 0x%x\n", *fb_sync_val, sync_val);
-#endif
-	usleep(10);
-    }
+    MBXFlushCommands(pVermilion);
 }
 
-static void
-mbxSetupForScreenToScreenCopy(ScrnInfoRec * pScrn,
-    int xdir, int ydir, int rop,
-    unsigned int planemask, int transparency_color)
+static Bool
+mbxFifoReady(ScrnInfoPtr pScrn, void *arg)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
-    CARD32 auBltPacket[4];
 
-    pVermilion->transEnable = 0;
+    MBXReadFifoSpace(pVermilion);
+    return pVermilion->FifoSlots >= *(CARD32 *) arg;
+}
 
-    pVermilion->ROP = XAAGetCopyROP(rop);
+/*
+ * Wait for n free slave port FIFO slots. If the MBX stops taking commands
+ * the server would hang here, so after a timeout everything outstanding
+ * is written off: all fences count as retired, and the commands that
+ * MBXFlushCommands() couldn't write are dropped.
+ */
 
-    pVermilion->dir = MBX2D_TEXTCOPY_TL2BR;
-    if (xdir < 0)
-	pVermilion->dir |= MBX2D_TEXTCOPY_TR2BL;
-    if (ydir < 0)
-	pVermilion->dir |= MBX2D_TEXTCOPY_BL2TR;
+Bool
+VERMILIONMBXWaitFifo(VERMILIONPtr pVermilion, CARD32 n)
+{
+    if (VERMILIONWait(pVermilion->pScrn, VERMILION_WAIT_FIFO, mbxFifoReady,
+	    &n))
+	return TRUE;
 
-    if (transparency_color != -1) {
-	pVermilion->transEnable = MBX2D_SRCCK_REJECT;
+    pVermilion->mbxSeqRetired = pVermilion->mbxSeqEmitted;
+    pVermilion->mbxStateValid = 0;
+    pVermilion->FifoSlots = 0;
 
-	WAITFIFO(3);
+    return FALSE;
+}
 
-	auBltPacket[0] = MBX2D_CTRL_BH | MBX2D_SRCCK_CTRL;
-	if (pScrn->depth == 15)
-	    auBltPacket[1] = transparency_color | transparency_color << 16;
-	else
-	    auBltPacket[1] = transparency_color;
-	auBltPacket[2] = 0xffffffff;
+/*
+ * Hand whatever is in the command buffer to the MBX.
+ */
 
-	WRITESLAVEPORTDATA(3);
-    }
+void
+VERMILIONMBXFlush(ScrnInfoPtr pScrn)
+{
+    MBXFlushCommands(VERMILIONPTR(pScrn));
+}
 
-    WAITFIFO(4);
+void
+VERMILIONMBXReport(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
 
-    auBltPacket[0] = MBX2D_SRC_CTRL_BH | MBX2D_SRC_FBMEM | pVermilion->mbxBpp;
-    auBltPacket[0] |= pVermilion->stride;
-    auBltPacket[1] = pVermilion->mbxFBDevAddr;
-    auBltPacket[2] = MBX2D_DST_CTRL_BH | pVermilion->mbxBpp;
-    auBltPacket[2] |= pVermilion->stride;
-    auBltPacket[3] = pVermilion->mbxFBDevAddr;
-    WRITESLAVEPORTDATA(4);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"MBX: %llu command dwords in %lu bursts, %lu FIFO status reads.\n",
+	pVermilion->cmdDwords, pVermilion->cmdBursts,
+	pVermilion->cmdStatusReads);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"MBX: %lu fences, %lu waits blocked, %lu found the work done.\n",
+	(unsigned long)pVermilion->mbxSeqEmitted, pVermilion->mbxWaits,
+	pVermilion->mbxWaitsIdle);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"MBX: state cache saved %llu command dwords.\n",
+	pVermilion->cmdSaved);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"MBX: %lu fills and %lu copies done by the CPU.\n",
+	pVermilion->cpuFills, pVermilion->cpuCopies);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"MBX: %lu mono pattern cache hits, %lu misses.\n",
+	pVermilion->patHits, pVermilion->patMisses);
 }
 
-static void
-mbxSubsequentScreenToScreenCopy(ScrnInfoRec * pScrn, int x1, int y1,
-    int x2, int y2, int w, int h)
+/*
+ * Queue a copy of a w x h block of packed pixels at srcAddr, srcPitch
+ * bytes per line, to (x, y) in the visible framebuffer.
+ */
+
+void
+VERMILIONMBXUpload(ScrnInfoPtr pScrn, CARD32 srcAddr, int srcPitch,
+    int x, int y, int w, int h)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
     CARD32 auBltPacket[5];
 
+    MBXSetSrcSurface(pVermilion, MBX2D_SRC_FBMEM | pVermilion->mbxBpp |
+	srcPitch, srcAddr);
+    MBXSetDstSurface(pVermilion, pVermilion->mbxBpp | pVermilion->stride,
+	pVermilion->mbxFBDevAddr);
+
     WAITFIFO(5);
 
-    auBltPacket[0] = MBX2D_SRC_OFF_BH | (x1 & 0xffff) << 14 | (y1 & 0xffff);
-    auBltPacket[1] = MBX2D_BLIT_BH | pVermilion->transEnable |
-	MBX2D_USE_PAT | pVermilion->dir |
-	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
-    auBltPacket[2] = (x2 & 0xffff) << 16 | (y2 & 0xffff);
-    auBltPacket[3] = ((x2 + w) & 0xffff) << 16 | ((y2 + h) & 0xffff);
+    auBltPacket[0] = MBX2D_SRC_OFF_BH;
+    auBltPacket[1] = MBX2D_BLIT_BH | MBX2D_USE_PAT | MBX2D_TEXTCOPY_TL2BR |
+	ROP_S << 8 | ROP_S;
+    auBltPacket[2] = (x & 0xffff) << 16 | (y & 0xffff);
+    auBltPacket[3] = ((x + w) & 0xffff) << 16 | ((y + h) & 0xffff);
     auBltPacket[4] = MBX2D_FENCE_BH;
 
     WRITESLAVEPORTDATA(5);
 }
 
-static void
-mbxSetupForFillRectSolid(ScrnInfoRec * pScrn, int color,
-    int rop, unsigned int planemask)
+/*
+ * Sequence numbers. Every fence gets the next 32 bit sequence number, and
+ * the MBX writes its low 16 bits to fence slot seq % MBX_FENCE_SLOTS when
+ * it gets there. Whether a given fence has landed can then be read
+ * straight from its slot. mbxSeqRetired caches the newest one known to
+ * have landed, so waiting for work that's already done costs no VRAM read
+ * at all. The 16 bit values are unambiguous as long as fewer than 32768
+ * fences are in flight, which VERMILIONMBXEmitSeq() makes sure of.
+ */
+
+#define MBX_SEQ_MASK 0xffff
+
+static Bool
+mbxSlotPassed(VERMILIONPtr pVermilion, CARD32 seq)
+{
+    CARD32 hw = pVermilion->mbxSyncMap[seq % MBX_FENCE_SLOTS];
+
+    return (INT16) ((hw - seq) & MBX_SEQ_MASK) >= 0;
+}
+
+/*
+ * Return a sequence number that covers everything queued so far, emitting
+ * a new fence only if something was queued since the last one.
+ */
+
+CARD32
+VERMILIONMBXEmitSeq(ScrnInfoPtr pScrn)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
-    CARD32 auBltPacket[2];
 
-    pVermilion->ROP = XAAGetPatternROP(rop);
+    if (!pVermilion->mbxDirty)
+	return pVermilion->mbxSeqEmitted;
 
-    if (pScrn->depth == 15) {
-	color |= 0x8000;
+    if (pVermilion->mbxSeqEmitted - pVermilion->mbxSeqRetired >=
+	MBX_SEQ_MASK / 2)
+	VERMILIONMBXWaitSeq(pScrn, pVermilion->mbxSeqRetired + 1);
+
+    pVermilion->mbxSeqEmitted++;
+    VERMILIONMBXFence(pScrn, pVermilion->mbxSyncDevAddr +
+	(pVermilion->mbxSeqEmitted % MBX_FENCE_SLOTS) * sizeof(CARD32),
+	pVermilion->mbxSeqEmitted & MBX_SEQ_MASK);
+    pVermilion->mbxDirty = FALSE;
+
+    return pVermilion->mbxSeqEmitted;
+}
+
+/*
+ * The sequence number that will cover the commands queued so far, whether
+ * or not its fence has been emitted yet.
+ */
+
+CARD32
+VERMILIONMBXPendingSeq(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    return pVermilion->mbxSeqEmitted + (pVermilion->mbxDirty ? 1 : 0);
+}
+
+Bool
+VERMILIONMBXSeqRetired(ScrnInfoPtr pScrn, CARD32 seq)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    if (MBX_SEQ_PASSED(pVermilion->mbxSeqRetired, seq))
+	return TRUE;
+
+    if (!MBX_SEQ_PASSED(pVermilion->mbxSeqEmitted, seq) ||
+	!mbxSlotPassed(pVermilion, seq))
+	return FALSE;
+
+    pVermilion->mbxSeqRetired = seq;
+    return TRUE;
+}
+
+static Bool
+mbxSeqReady(ScrnInfoPtr pScrn, void *arg)
+{
+    return VERMILIONMBXSeqRetired(pScrn, *(CARD32 *) arg);
+}
+
+void
+VERMILIONMBXWaitSeq(ScrnInfoPtr pScrn, CARD32 seq)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    /* A pending sequence number needs its fence emitted first. */
+    if (!MBX_SEQ_PASSED(pVermilion->mbxSeqEmitted, seq)) {
+	VERMILIONMBXEmitSeq(pScrn);
+	if (!MBX_SEQ_PASSED(pVermilion->mbxSeqEmitted, seq))
+	    seq = pVermilion->mbxSeqEmitted;
     }
 
-    pVermilion->fillColour = color;
+    if (VERMILIONMBXSeqRetired(pScrn, seq)) {
+	pVermilion->mbxWaitsIdle++;
+	return;
+    }
 
-    WAITFIFO(2);
+    pVermilion->mbxWaits++;
+    if (!VERMILIONWait(pScrn, VERMILION_WAIT_SEQ, mbxSeqReady, &seq)) {
+	/* Carry on as if the MBX had finished rather than hang. */
+	pVermilion->mbxSeqRetired = pVermilion->mbxSeqEmitted;
+    }
+}
 
-    auBltPacket[0] = MBX2D_DST_CTRL_BH | pVermilion->mbxBpp;
-    auBltPacket[0] |= pVermilion->stride;
-    auBltPacket[1] = pVermilion->mbxFBDevAddr;
-    WRITESLAVEPORTDATA(2);
+/*
+ * The last MBX sequence numbers that read and wrote each surface are kept
+ * in a direct mapped table keyed by VRAM offset, so that CPU access to a
+ * surface only waits for the blits that touch it. EXA keeps a surface per
+ * pixmap, XAA one per band of framebuffer rows. An entry that loses its
+ * slot leaves its sequence numbers in surfaceFloor, which every surface
+ * new to the table then starts out with. The slot is the top bits of a
+ * multiplicative hash; the low bits only depend on the low bits of the
+ * offset, so offsets a multiple of 8 kB apart would share one.
+ */
+
+#define MBX_SURFACE_ALIGN 32
+
+VERMILIONSurfacePtr
+VERMILIONMBXSurfaceSlot(VERMILIONPtr pVermilion, unsigned long offset)
+{
+    CARD32 hash = (CARD32) (offset / MBX_SURFACE_ALIGN) * 2654435761U;
+
+    return &pVermilion->surfaces[hash >> (32 - VERMILION_SURFACE_BITS)];
+}
+
+void
+VERMILIONMBXSurfaceRetire(VERMILIONPtr pVermilion, VERMILIONSurfacePtr surf)
+{
+    if (MBX_SEQ_PASSED(surf->lastRead, pVermilion->surfaceFloor))
+	pVermilion->surfaceFloor = surf->lastRead;
+    if (MBX_SEQ_PASSED(surf->lastWrite, pVermilion->surfaceFloor))
+	pVermilion->surfaceFloor = surf->lastWrite;
+    surf->valid = FALSE;
+}
+
+VERMILIONSurfacePtr
+VERMILIONMBXSurface(VERMILIONPtr pVermilion, unsigned long offset)
+{
+    VERMILIONSurfacePtr surf = VERMILIONMBXSurfaceSlot(pVermilion, offset);
+
+    if (!surf->valid || surf->offset != offset) {
+	if (surf->valid)
+	    VERMILIONMBXSurfaceRetire(pVermilion, surf);
+	surf->valid = TRUE;
+	surf->offset = offset;
+	surf->lastRead = pVermilion->surfaceFloor;
+	surf->lastWrite = pVermilion->surfaceFloor;
+    }
+
+    return surf;
+}
+
+/*
+ * Wait for the MBX to finish everything queued so far.
+ */
+
+void
+VERMILIONMBXSync(ScrnInfoPtr pScrn)
+{
+    VERMILIONMBXWaitSeq(pScrn, VERMILIONMBXEmitSeq(pScrn));
+}
+
+/*
+ * VRAM and the engine may have been used by someone else while we were
+ * switched away. Everything we queued retired before LeaveVT returned.
+ */
+
+void
+VERMILIONMBXReset(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    int i;
+
+    if (!pVermilion->mbxSyncMap)
+	return;
+
+    /* The submission thread owns the FIFO bookkeeping; idle it first. */
+    if (pVermilion->mbxSubmit)
+	VERMILIONSubmitDrain(pVermilion->mbxSubmit);
+
+    for (i = 0; i < MBX_FENCE_SLOTS; i++)
+	pVermilion->mbxSyncMap[i] = pVermilion->mbxSeqEmitted & MBX_SEQ_MASK;
+    pVermilion->mbxSeqRetired = pVermilion->mbxSeqEmitted;
+    pVermilion->mbxDirty = FALSE;
+    pVermilion->FifoSlots = 0;
+    pVermilion->cmdCount = 0;
+    pVermilion->hostOwed = 0;
+    pVermilion->cmdOwed = 0;
+    pVermilion->mbxStateValid = 0;
+    pVermilion->palValid = FALSE;
+    for (i = 0; i < VERMILION_PAT_SLOTS; i++)
+	pVermilion->patterns[i].valid = FALSE;
+}
+
+/*
+ * Forget the cached engine state, see vermilion_mbx.h. The mode, and with
+ * it the framebuffer stride, is about to change.
+ */
+
+void
+VERMILIONMBXInvalidateState(ScrnInfoPtr pScrn)
+{
+    VERMILIONPTR(pScrn)->mbxStateValid = 0;
 }
 
+/*
+ * Small operations. Handing a few pixels to the MBX costs a slave port
+ * round trip, and the fence it leaves outstanding makes the next software
+ * fallback wait. When the engine has nothing queued that could touch the
+ * pixels, small enough fills and copies are done by the CPU instead.
+ * "Small enough" is measured by VERMILIONMBXCalibrate().
+ *
+ * XAA draws everything in the one framebuffer surface, so the surface
+ * table tracks it in bands of MBX_BAND_ROWS rows, keyed by the offset of
+ * the band. mbxMarkRows() notes the rows a blit about to be queued reads
+ * or writes, and mbxIdle() checks that none still being written, or for
+ * a write read either, are covered by a pending fence.
+ */
+
+#define MBX_BAND_ROWS 64
+
 static void
-mbxSubsequentFillRectSolid(ScrnInfoRec * pScrn, int x, int y, int w, int h)
+mbxMarkRows(VERMILIONPtr pVermilion, int y, int h, Bool write)
+{
+    /* The fence that will follow the blit */
+    CARD32 seq = pVermilion->mbxSeqEmitted + 1;
+    VERMILIONSurfacePtr surf;
+    int band;
+
+    for (band = y / MBX_BAND_ROWS; band <= (y + h - 1) / MBX_BAND_ROWS;
+	band++) {
+	surf = VERMILIONMBXSurface(pVermilion,
+	    (unsigned long)band * MBX_BAND_ROWS * pVermilion->stride);
+	if (write)
+	    surf->lastWrite = seq;
+	else
+	    surf->lastRead = seq;
+    }
+}
+
+static Bool
+mbxIdle(ScrnInfoPtr pScrn, int y, int h, Bool write)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
-    CARD32 auBltPacket[5];
+    VERMILIONSurfacePtr surf;
+    int band;
 
-    WAITFIFO(5);
+    for (band = y / MBX_BAND_ROWS; band <= (y + h - 1) / MBX_BAND_ROWS;
+	band++) {
+	surf = VERMILIONMBXSurface(pVermilion,
+	    (unsigned long)band * MBX_BAND_ROWS * pVermilion->stride);
+	if (!VERMILIONMBXSeqRetired(pScrn, surf->lastWrite) ||
+	    (write && !VERMILIONMBXSeqRetired(pScrn, surf->lastRead)))
+	    return FALSE;
+    }
 
-    auBltPacket[0] = MBX2D_BLIT_BH |
-	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
-    auBltPacket[1] = pVermilion->fillColour;
-    auBltPacket[2] = (x & 0xffff) << 16 | (y & 0xffff);
-    auBltPacket[3] = ((x + w) & 0xffff) << 16 | ((y + h) & 0xffff);
-    auBltPacket[4] = MBX2D_FENCE_BH;
-    WRITESLAVEPORTDATA(5);
+    return TRUE;
+}
+
+void
+VERMILIONCPUFill(ScrnInfoPtr pScrn, CARD8 *base, int pitch, int x, int y,
+    int w, int h, CARD32 colour)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD8 *dst = base + y * pitch + x * pVermilion->cpp;
+    int i;
+
+    while (h--) {
+	if (pVermilion->cpp == 2) {
+	    for (i = 0; i < w; i++)
+		((CARD16 *) dst)[i] = colour;
+	} else {
+	    for (i = 0; i < w; i++)
+		((CARD32 *) dst)[i] = colour;
+	}
+	dst += pitch;
+    }
+
+    /* Land the pixels before any later blit reads them. */
+    write_mem_barrier();
+    pVermilion->cpuFills++;
+}
+
+void
+VERMILIONCPUCopy(ScrnInfoPtr pScrn, CARD8 *srcBase, int srcPitch,
+    CARD8 *dstBase, int dstPitch, int srcX, int srcY, int dstX, int dstY,
+    int w, int h, int ydir)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD8 *src = srcBase + srcY * srcPitch + srcX * pVermilion->cpp;
+    CARD8 *dst = dstBase + dstY * dstPitch + dstX * pVermilion->cpp;
+    int bytes = w * pVermilion->cpp;
+
+    if (ydir < 0) {
+	src += (h - 1) * srcPitch;
+	dst += (h - 1) * dstPitch;
+	srcPitch = -srcPitch;
+	dstPitch = -dstPitch;
+    }
+
+    while (h--) {
+	memmove(dst, src, bytes);
+	src += srcPitch;
+	dst += dstPitch;
+    }
+
+    write_mem_barrier();
+    pVermilion->cpuCopies++;
+}
+
+/*
+ * Point the source or destination at the framebuffer, rebased as needed
+ * for a blit covering rows y to y + h. Makes y relative to the surface.
+ */
+
+static void
+mbxSetScreenDst(VERMILIONPtr pVermilion, int *y, int h)
+{
+    int row;
+
+    mbxMarkRows(pVermilion, *y, h, TRUE);
+    row = MBXRebaseRow(y, h);
+
+    MBXSetDstSurface(pVermilion, pVermilion->mbxBpp | pVermilion->stride,
+	pVermilion->mbxFBDevAddr + row * pVermilion->stride);
+}
+
+static void
+mbxSetScreenSrc(VERMILIONPtr pVermilion, int *y, int h)
+{
+    int row;
+
+    mbxMarkRows(pVermilion, *y, h, FALSE);
+    row = MBXRebaseRow(y, h);
+
+    MBXSetSrcSurface(pVermilion, MBX2D_SRC_FBMEM | pVermilion->mbxBpp |
+	pVermilion->stride,
+	pVermilion->mbxFBDevAddr + row * pVermilion->stride);
+}
+
+#define MBX_CALIBRATE_REPS 16
+#define MBX_CALIBRATE_MAX 128
+
+static void
+mbxCalibrateFill(ScrnInfoPtr pScrn, int y, int s, CARD32 colour)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 auBltPacket[5];
+
+    mbxSetScreenDst(pVermilion, &y, s);
+
+    WAITFIFO(5);
+
+    auBltPacket[0] = MBX2D_BLIT_BH | ROP_P << 8 | ROP_P;
+    auBltPacket[1] = colour;
+    auBltPacket[2] = (y & 0xffff);
+    auBltPacket[3] = (s & 0xffff) << 16 | ((y + s) & 0xffff);
+    auBltPacket[4] = MBX2D_FENCE_BH;
+    WRITESLAVEPORTDATA(5);
+}
+
+/*
+ * Find the largest square fill and copy, in pixels, that the CPU does
+ * faster than a round trip through the MBX, unless the CPUThreshold
+ * option has set it. The squares are drawn in the offscreen memory below
+ * the visible framebuffer, before any pixmaps have been put there.
+ */
+
+void
+VERMILIONMBXCalibrate(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD8 *base = pVermilion->fbMap;
+    CARD32 colour = (pScrn->depth == 15) ? 0x8000 : 0;
+    unsigned long long start, cpu, mbx;
+    int y, rows, max, s, i;
+    Bool fillDone = FALSE, copyDone = FALSE;
+
+    pVermilion->cpuFills = 0;
+    pVermilion->cpuCopies = 0;
+
+    if (pVermilion->cpuThreshold >= 0) {
+	pVermilion->cpuFillMax = pVermilion->cpuThreshold;
+	pVermilion->cpuCopyMax = pVermilion->cpuThreshold;
+	xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+	    "CPU does fills and copies of up to %d pixels.\n",
+	    pVermilion->cpuThreshold);
+	return;
+    }
+
+    pVermilion->cpuFillMax = 0;
+    pVermilion->cpuCopyMax = 0;
+
+    /* Copies read from the square below the one they write. */
+    y = pScrn->virtualY;
+    rows = (pVermilion->fbSize - MBX_SYNC_MAP_SIZE) / pVermilion->stride - y;
+    max = min(MBX_CALIBRATE_MAX, min(pScrn->virtualX, rows / 2));
+    if (max < 2) {
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "No offscreen memory to time CPU fills and copies in, "
+	    "the MBX does them all.\n");
+	return;
+    }
+
+    VERMILIONMBXSync(pScrn);
+
+    for (s = 2; s <= max && !(fillDone && copyDone); s *= 2) {
+	if (!fillDone) {
+	    start = VERMILIONUsecs();
+	    for (i = 0; i < MBX_CALIBRATE_REPS; i++)
+		VERMILIONCPUFill(pScrn, base, pVermilion->stride, 0, y, s, s,
+		    colour);
+	    cpu = VERMILIONUsecs() - start;
+
+	    start = VERMILIONUsecs();
+	    for (i = 0; i < MBX_CALIBRATE_REPS; i++) {
+		mbxCalibrateFill(pScrn, y, s, colour);
+		VERMILIONMBXSync(pScrn);
+	    }
+	    mbx = VERMILIONUsecs() - start;
+
+	    if (cpu <= mbx)
+		pVermilion->cpuFillMax = s * s;
+	    else
+		fillDone = TRUE;
+	}
+
+	if (!copyDone) {
+	    start = VERMILIONUsecs();
+	    for (i = 0; i < MBX_CALIBRATE_REPS; i++)
+		VERMILIONCPUCopy(pScrn, base, pVermilion->stride, base,
+		    pVermilion->stride, 0, y + max, 0, y, s, s, 1);
+	    cpu = VERMILIONUsecs() - start;
+
+	    start = VERMILIONUsecs();
+	    for (i = 0; i < MBX_CALIBRATE_REPS; i++) {
+		VERMILIONMBXUpload(pScrn, pVermilion->mbxFBDevAddr +
+		    (y + max) * pVermilion->stride, pVermilion->stride,
+		    0, y, s, s);
+		VERMILIONMBXSync(pScrn);
+	    }
+	    mbx = VERMILIONUsecs() - start;
+
+	    if (cpu <= mbx)
+		pVermilion->cpuCopyMax = s * s;
+	    else
+		copyDone = TRUE;
+	}
+    }
+
+    pVermilion->cpuFills = 0;
+    pVermilion->cpuCopies = 0;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_PROBED,
+	"CPU does fills of up to %d and copies of up to %d pixels.\n",
+	pVermilion->cpuFillMax, pVermilion->cpuCopyMax);
+}
+
+static void
+mbxSetupForScreenToScreenCopy(ScrnInfoRec * pScrn,
+    int xdir, int ydir, int rop,
+    unsigned int planemask, int transparency_color)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->transEnable = 0;
+
+    pVermilion->ROP = XAAGetCopyROP(rop);
+    pVermilion->cpuOK = (rop == GXcopy && transparency_color == -1);
+
+    pVermilion->dir = MBX2D_TEXTCOPY_TL2BR;
+    if (xdir < 0)
+	pVermilion->dir |= MBX2D_TEXTCOPY_TR2BL;
+    if (ydir < 0)
+	pVermilion->dir |= MBX2D_TEXTCOPY_BL2TR;
+
+    if (transparency_color != -1) {
+	pVermilion->transEnable = MBX2D_SRCCK_REJECT;
+
+	if (pScrn->depth == 15)
+	    MBXSetColorKey(pVermilion,
+		transparency_color | transparency_color << 16, 0xffffffff);
+	else
+	    MBXSetColorKey(pVermilion, transparency_color, 0xffffffff);
+    }
+}
+
+static void
+mbxSubsequentScreenToScreenCopy(ScrnInfoRec * pScrn, int x1, int y1,
+    int x2, int y2, int w, int h)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 auBltPacket[5];
+
+    if (pVermilion->cpuOK && w * h <= pVermilion->cpuCopyMax &&
+	mbxIdle(pScrn, y1, h, FALSE) && mbxIdle(pScrn, y2, h, TRUE)) {
+	VERMILIONCPUCopy(pScrn, pVermilion->fbMap, pVermilion->stride,
+	    pVermilion->fbMap, pVermilion->stride, x1, y1, x2, y2, w, h,
+	    (pVermilion->dir & MBX2D_TEXTCOPY_BL2TR) ? -1 : 1);
+	return;
+    }
+
+    mbxSetScreenSrc(pVermilion, &y1, h);
+    mbxSetScreenDst(pVermilion, &y2, h);
+
+    WAITFIFO(5);
+
+    auBltPacket[0] = MBX2D_SRC_OFF_BH | (x1 & 0xffff) << 14 | (y1 & 0xffff);
+    auBltPacket[1] = MBX2D_BLIT_BH | pVermilion->transEnable |
+	MBX2D_USE_PAT | pVermilion->dir |
+	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
+    auBltPacket[2] = (x2 & 0xffff) << 16 | (y2 & 0xffff);
+    auBltPacket[3] = ((x2 + w) & 0xffff) << 16 | ((y2 + h) & 0xffff);
+    auBltPacket[4] = MBX2D_FENCE_BH;
+
+    WRITESLAVEPORTDATA(5);
+}
+
+static void
+mbxSetupForFillRectSolid(ScrnInfoRec * pScrn, int color,
+    int rop, unsigned int planemask)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->ROP = XAAGetPatternROP(rop);
+    pVermilion->cpuOK = (rop == GXcopy);
+
+    if (pScrn->depth == 15) {
+	color |= 0x8000;
+    }
+
+    pVermilion->fillColour = color;
+}
+
+/*
+ * The four dwords of a fill with the current colour and ROP.
+ */
+
+static void
+mbxSolidRect(VERMILIONPtr pVermilion, CARD32 *auBltPacket,
+    int x, int y, int w, int h)
+{
+    auBltPacket[0] = MBX2D_BLIT_BH |
+	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
+    auBltPacket[1] = pVermilion->fillColour;
+    auBltPacket[2] = (x & 0xffff) << 16 | (y & 0xffff);
+    auBltPacket[3] = ((x + w) & 0xffff) << 16 | ((y + h) & 0xffff);
+}
+
+static void
+mbxSubsequentFillRectSolid(ScrnInfoRec * pScrn, int x, int y, int w, int h)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 auBltPacket[5];
+
+    if (pVermilion->cpuOK && w * h <= pVermilion->cpuFillMax &&
+	mbxIdle(pScrn, y, h, TRUE)) {
+	VERMILIONCPUFill(pScrn, pVermilion->fbMap, pVermilion->stride,
+	    x, y, w, h, pVermilion->fillColour);
+	return;
+    }
+
+    mbxSetScreenDst(pVermilion, &y, h);
+
+    WAITFIFO(5);
+
+    mbxSolidRect(pVermilion, auBltPacket, x, y, w, h);
+    auBltPacket[4] = MBX2D_FENCE_BH;
+    WRITESLAVEPORTDATA(5);
+}
+
+static void
+mbxSubsequentSolidHorVertLine(ScrnInfoRec * pScrn, int x, int y, int len,
+    int dir)
+{
+    if (dir == DEGREES_0)
+	mbxSubsequentFillRectSolid(pScrn, x, y, len, 1);
+    else
+	mbxSubsequentFillRectSolid(pScrn, x, y, 1, len);
+}
+
+/*
+ * Sloped lines, split into runs along the major axis. Each run is one
+ * fill, and the runs of a line don't overlap, so they only need a fence
+ * after the last one. absmaj and absmin come doubled, and err starts at
+ * -absmaj / 2 less the bias, so that each pixel is:
+ *
+ *	err += absmin;
+ *	if (err >= 0) { step along the minor axis; err -= absmaj; }
+ */
+
+static void
+mbxSubsequentSolidBresenhamLine(ScrnInfoRec * pScrn, int x, int y,
+    int absmaj, int absmin, int err, int len, int octant)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    int xdir = (octant & XDECREASING) ? -1 : 1;
+    int ydir = (octant & YDECREASING) ? -1 : 1;
+    int run, rx, ry, rw, rh, row, base = -1;
+    CARD32 auBltPacket[4];
+
+    while (len > 0) {
+	/* Pixels up to and including the next minor step */
+	for (run = 1; run < len; run++) {
+	    err += absmin;
+	    if (err >= 0) {
+		err -= absmaj;
+		break;
+	    }
+	}
+
+	if (octant & YMAJOR) {
+	    rx = x;
+	    ry = (ydir > 0) ? y : y - run + 1;
+	    rw = 1;
+	    rh = run;
+	    y += ydir * run;
+	    x += xdir;
+	} else {
+	    rx = (xdir > 0) ? x : x - run + 1;
+	    ry = y;
+	    rw = run;
+	    rh = 1;
+	    x += xdir * run;
+	    y += ydir;
+	}
+
+	/*
+	 * A long line can cross into rows that need the destination
+	 * rebased. The runs drawn so far must finish before the surface
+	 * moves under them.
+	 */
+	row = MBXRebaseRow(&ry, rh);
+	if (base >= 0 && row != base) {
+	    WAITFIFO(1);
+	    auBltPacket[0] = MBX2D_FENCE_BH;
+	    WRITESLAVEPORTDATA(1);
+	}
+	base = row;
+	mbxMarkRows(pVermilion, ry + row, rh, TRUE);
+	MBXSetDstSurface(pVermilion, pVermilion->mbxBpp | pVermilion->stride,
+	    pVermilion->mbxFBDevAddr + row * pVermilion->stride);
+
+	WAITFIFO(4);
+
+	mbxSolidRect(pVermilion, auBltPacket, rx, ry, rw, rh);
+	WRITESLAVEPORTDATA(4);
+	len -= run;
+    }
+
+    WAITFIFO(1);
+
+    auBltPacket[0] = MBX2D_FENCE_BH;
+    WRITESLAVEPORTDATA(1);
+}
+
+/*
+ * Host data blits. The source is written to the slave port right after
+ * the blit block, one scanline of hostDwords dwords at a time, and the
+ * caller ends the blit with a fence once all of it is queued. The
+ * destination surface and hostDwords must already be set.
+ */
+
+static void
+mbxHostBlit(ScrnInfoPtr pScrn, CARD32 srcCtrl, CARD32 rop, CARD32 trans,
+    int skipleft, int x, int y, int w, int h)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 auBltPacket[4];
+
+    MBXSetSrcSurface(pVermilion, srcCtrl, 0);
+
+    WAITFIFO(4);
+
+    auBltPacket[0] = MBX2D_SRC_OFF_BH | (skipleft & 0xffff) << 14;
+    auBltPacket[1] = MBX2D_BLIT_BH | trans | MBX2D_USE_PAT |
+	MBX2D_TEXTCOPY_TL2BR | (rop & 0xff) << 8 | (rop & 0xff);
+    auBltPacket[2] = (x & 0xffff) << 16 | (y & 0xffff);
+    auBltPacket[3] = ((x + w) & 0xffff) << 16 | ((y + h) & 0xffff);
+
+    WRITESLAVEPORTDATA(4);
+
+    pVermilion->hostOwed = pVermilion->hostDwords * h;
+}
+
+static void
+mbxHostBlitDone(VERMILIONPtr pVermilion)
+{
+    CARD32 auBltPacket[1];
+
+    WAITFIFO(1);
+
+    auBltPacket[0] = MBX2D_FENCE_BH;
+    WRITESLAVEPORTDATA(1);
+}
+
+/*
+ * Pixels get the ARGB1555 alpha bit at depth 15 as they're queued.
+ */
+
+static CARD32
+mbxHostAlpha(ScrnInfoPtr pScrn)
+{
+    return (pScrn->depth == 15) ? 0x80008000 : 0;
+}
+
+/*
+ * Write a w x h image at src, srcPitch bytes per line, to (x, y) of the
+ * surface at dstAddr through the slave port. The image is in the command
+ * stream once this returns, so src can be reused straight away.
+ */
+
+void
+VERMILIONMBXWriteImage(ScrnInfoPtr pScrn, CARD32 dstAddr, int dstPitch,
+    int x, int y, int w, int h, const CARD8 *src, int srcPitch)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 alpha = mbxHostAlpha(pScrn);
+    CARD32 dwords = (w * pVermilion->cpp + 3) >> 2;
+
+    dstAddr += MBXRebaseRow(&y, h) * dstPitch;
+    pVermilion->hostDwords = dwords;
+
+    MBXSetDstSurface(pVermilion, pVermilion->mbxBpp | dstPitch, dstAddr);
+    mbxHostBlit(pScrn, pVermilion->mbxBpp | dwords * 4, ROP_S, 0, 0,
+	x, y, w, h);
+
+    while (h--) {
+	MBXQueueHostData(pVermilion, (const CARD32 *)src, dwords, alpha);
+	src += srcPitch;
+    }
+
+    mbxHostBlitDone(pVermilion);
+}
+
+static void
+mbxSetupForScanlineImageWrite(ScrnInfoRec * pScrn, int rop,
+    unsigned int planemask, int transparency_color, int bpp, int depth)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->ROP = XAAGetCopyROP(rop);
+    pVermilion->transEnable = 0;
+
+    if (transparency_color != -1) {
+	pVermilion->transEnable = MBX2D_SRCCK_REJECT;
+	/* Image data at depth 24 may have anything in the top byte. */
+	MBXSetColorKey(pVermilion, mbxPackColour(pScrn, transparency_color),
+	    (pScrn->depth == 15) ? 0xffffffff : 0x00ffffff);
+    }
+}
+
+static void
+mbxSubsequentScanlineImageWriteRect(ScrnInfoRec * pScrn,
+    int x, int y, int w, int h, int skipleft)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->hostDwords = ((w + skipleft) * pVermilion->cpp + 3) >> 2;
+    pVermilion->hostLines = h;
+
+    mbxSetScreenDst(pVermilion, &y, h);
+    mbxHostBlit(pScrn, pVermilion->mbxBpp | pVermilion->hostDwords * 4,
+	pVermilion->ROP, pVermilion->transEnable, skipleft, x, y, w, h);
+}
+
+static void
+mbxSubsequentImageWriteScanline(ScrnInfoRec * pScrn, int bufno)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    MBXQueueHostData(pVermilion, pVermilion->hostScanline,
+	pVermilion->hostDwords, mbxHostAlpha(pScrn));
+
+    if (--pVermilion->hostLines == 0)
+	mbxHostBlitDone(pVermilion);
+}
+
+/*
+ * Colour expansion. The MBX expands 1 bpp host data through a two entry
+ * source palette in VRAM, background first. Palettes are used round robin
+ * from VERMILION_PAL_SLOTS slots after the fence slots, each remembering
+ * the sequence number of the last blit that read it, so a slot is only
+ * rewritten once the MBX is done with it. Transparent expansion gets a
+ * background that differs from the foreground and colour keys it out.
+ */
+
+static CARD32
+mbxPackColour(ScrnInfoPtr pScrn, CARD32 colour)
+{
+    if (pScrn->depth == 15) {
+	colour = (colour & 0x7fff) | 0x8000;
+	return colour | colour << 16;
+    }
+
+    return colour & 0x00ffffff;
+}
+
+static CARD32
+mbxSetPalette(ScrnInfoPtr pScrn, CARD32 fg, CARD32 bg)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    volatile CARD32 *pal;
+    int slot = pVermilion->palSlot;
+
+    if (!pVermilion->palValid || pVermilion->palFg != fg ||
+	pVermilion->palBg != bg) {
+	slot = (slot + 1) % VERMILION_PAL_SLOTS;
+	VERMILIONMBXWaitSeq(pScrn, pVermilion->palSeq[slot]);
+
+	pal = pVermilion->mbxSyncMap + MBX_FENCE_SLOTS + slot * 2;
+	pal[0] = bg;
+	pal[1] = fg;
+	write_mem_barrier();
+
+	pVermilion->palSlot = slot;
+	pVermilion->palFg = fg;
+	pVermilion->palBg = bg;
+	pVermilion->palValid = TRUE;
+    }
+
+    return pVermilion->mbxSyncDevAddr + MBX_FENCE_SLOTS * 4 + slot * 8;
+}
+
+static void
+mbxSetupForScanlineCPUToScreenColorExpandFill(ScrnInfoRec * pScrn,
+    int fg, int bg, int rop, unsigned int planemask)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 fgPacked = mbxPackColour(pScrn, fg);
+    CARD32 bgPacked;
+    CARD32 palAddr;
+    CARD32 auBltPacket[2];
+
+    pVermilion->ROP = XAAGetCopyROP(rop);
+    pVermilion->transEnable = 0;
+
+    if (bg == -1) {
+	bgPacked = fgPacked ^ ((pScrn->depth == 15) ? 0x7fff7fff : 0x00ffffff);
+	pVermilion->transEnable = MBX2D_SRCCK_REJECT;
+	MBXSetColorKey(pVermilion, bgPacked, 0xffffffff);
+    } else {
+	bgPacked = mbxPackColour(pScrn, bg);
+    }
+
+    palAddr = mbxSetPalette(pScrn, fgPacked, bgPacked);
+
+    WAITFIFO(2);
+
+    auBltPacket[0] = MBX2D_SRC_PAL_BH;
+    auBltPacket[1] = palAddr;
+    WRITESLAVEPORTDATA(2);
+}
+
+static void
+mbxSubsequentScanlineCPUToScreenColorExpandFill(ScrnInfoRec * pScrn,
+    int x, int y, int w, int h, int skipleft)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->hostDwords = (w + skipleft + 31) >> 5;
+    pVermilion->hostLines = h;
+
+    mbxSetScreenDst(pVermilion, &y, h);
+    mbxHostBlit(pScrn, MBX2D_SRC_1_PAL | pVermilion->hostDwords * 4,
+	pVermilion->ROP, pVermilion->transEnable, skipleft, x, y, w, h);
+}
+
+static void
+mbxSubsequentColorExpandScanline(ScrnInfoRec * pScrn, int bufno)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    MBXQueueHostData(pVermilion, pVermilion->hostScanline,
+	pVermilion->hostDwords, 0);
+
+    if (--pVermilion->hostLines == 0) {
+	mbxHostBlitDone(pVermilion);
+	pVermilion->palSeq[pVermilion->palSlot] =
+	    VERMILIONMBXPendingSeq(pScrn);
+    }
+}
+
+/*
+ * 8x8 pattern fills. The pattern surface is either a slot of the mono
+ * pattern cache or XAA's cached copy of a colour pattern. Mono patterns
+ * are looked up by bits and colours, and a miss expands the pattern on
+ * the CPU into the next slot round robin once the MBX is done with it.
+ */
+
+static VERMILIONPatternPtr
+mbxCacheMonoPattern(ScrnInfoPtr pScrn, CARD32 bits0, CARD32 bits1,
+    CARD32 fg, CARD32 bg)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONPatternPtr pat;
+    CARD8 *map, *row;
+    CARD8 rowBits;
+    int i, x, y;
+
+    for (i = 0; i < VERMILION_PAT_SLOTS; i++) {
+	pat = &pVermilion->patterns[i];
+	if (pat->valid && pat->bits[0] == bits0 && pat->bits[1] == bits1 &&
+	    pat->fg == fg && pat->bg == bg) {
+	    pVermilion->patHits++;
+	    return pat;
+	}
+    }
+
+    pVermilion->patMisses++;
+
+    i = pVermilion->patNext;
+    pVermilion->patNext = (i + 1) % VERMILION_PAT_SLOTS;
+
+    pat = &pVermilion->patterns[i];
+    if (pat->valid)
+	VERMILIONMBXWaitSeq(pScrn, pat->seq);
+
+    map = (CARD8 *)pVermilion->mbxSyncMap + MBX_SYNC_MAP_SIZE -
+	MBX_PAT_MAP_SIZE + i * MBX_PAT_SLOT_SIZE;
+
+    /* A byte per row, LSB first */
+    for (y = 0; y < 8; y++) {
+	rowBits = ((y < 4) ? bits0 : bits1) >> ((y & 3) * 8);
+	row = map + y * MBX_PAT_PITCH;
+	for (x = 0; x < 8; x++) {
+	    if (pScrn->depth == 15)
+		((CARD16 *) row)[x] = (rowBits & (1 << x)) ? fg : bg;
+	    else
+		((CARD32 *) row)[x] = (rowBits & (1 << x)) ? fg : bg;
+	}
+    }
+    write_mem_barrier();
+
+    pat->bits[0] = bits0;
+    pat->bits[1] = bits1;
+    pat->fg = fg;
+    pat->bg = bg;
+    pat->seq = VERMILIONMBXPendingSeq(pScrn);
+    pat->valid = TRUE;
+
+    return pat;
+}
+
+static void
+mbxSetupForMono8x8PatternFill(ScrnInfoRec * pScrn,
+    int patx, int paty, int fg, int bg, int rop, unsigned int planemask)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONPatternPtr pat;
+
+    pat = mbxCacheMonoPattern(pScrn, patx, paty, mbxPackColour(pScrn, fg),
+	mbxPackColour(pScrn, bg));
+
+    pVermilion->ROP = XAAGetPatternROP(rop);
+    pVermilion->pattern = pat;
+    pVermilion->patAddr = pVermilion->mbxSyncDevAddr + MBX_SYNC_MAP_SIZE -
+	MBX_PAT_MAP_SIZE + (pat - pVermilion->patterns) * MBX_PAT_SLOT_SIZE;
+    pVermilion->patPitch = MBX_PAT_PITCH;
+}
+
+static void
+mbxSetupForColor8x8PatternFill(ScrnInfoRec * pScrn,
+    int patx, int paty, int rop, unsigned int planemask,
+    int transparency_color)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->ROP = XAAGetPatternROP(rop);
+    pVermilion->pattern = NULL;
+    pVermilion->patAddr = pVermilion->mbxFBDevAddr +
+	paty * pVermilion->stride + patx * pVermilion->cpp;
+    pVermilion->patPitch = pVermilion->stride;
+}
+
+static void
+mbxSubsequent8x8PatternFillRect(ScrnInfoRec * pScrn,
+    int patx, int paty, int x, int y, int w, int h)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 auBltPacket[5];
+
+    MBXSetPatSurface(pVermilion, pVermilion->mbxBpp | pVermilion->patPitch,
+	pVermilion->patAddr);
+    /* Colour patterns are read from the pixmap cache */
+    if (!pVermilion->pattern)
+	mbxMarkRows(pVermilion, (pVermilion->patAddr -
+		pVermilion->mbxFBDevAddr) / pVermilion->stride, 8, FALSE);
+    mbxSetScreenDst(pVermilion, &y, h);
+
+    WAITFIFO(5);
+
+    auBltPacket[0] = MBX2D_PAT_BH | 8 << MBX2D_PAT_WIDTH_SHIFT |
+	8 << MBX2D_PAT_HEIGHT_SHIFT | (patx & 7) << MBX2D_PAT_XSTART_SHIFT |
+	(paty & 7) << MBX2D_PAT_YSTART_SHIFT;
+    auBltPacket[1] = MBX2D_BLIT_BH | MBX2D_USE_PAT |
+	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
+    auBltPacket[2] = (x & 0xffff) << 16 | (y & 0xffff);
+    auBltPacket[3] = ((x + w) & 0xffff) << 16 | ((y + h) & 0xffff);
+    auBltPacket[4] = MBX2D_FENCE_BH;
+    WRITESLAVEPORTDATA(5);
+
+    if (pVermilion->pattern)
+	pVermilion->pattern->seq = VERMILIONMBXPendingSeq(pScrn);
+}
+
+static void
+mbxWritePixmap15(ScrnInfoRec * pScrn, int x, int y, int w, int h,
+    unsigned char *src, int srcwidth, int rop, unsigned int planemask,
+    int transparency_color, int bpp, int depth)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    /* Only small images are worth a sync, see VERMILIONMBXCalibrate(). */
+    if (w * h > pVermilion->cpuCopyMax) {
+	mbxMarkRows(pVermilion, y, h, TRUE);
+	VERMILIONMBXWriteImage(pScrn, pVermilion->mbxFBDevAddr,
+	    pVermilion->stride, x, y, w, h, src, srcwidth);
+	return;
+    }
+
+    VERMILIONMBXSync(pScrn);
+    cpuWritePixmap15(pScrn, x, y, w, h, src, srcwidth, rop, planemask,
+	transparency_color, bpp, depth);
+}
+
+static void
+mbxWriteBitmap15(ScrnInfoRec * pScrn, int x, int y, int w, int h,
+    unsigned char *src, int srcwidth, int skipleft, int fg, int bg,
+    int rop, unsigned int planemask)
+{
+    VERMILIONMBXSync(pScrn);
+    cpuWriteBitmap15(pScrn, x, y, w, h, src, srcwidth, skipleft, fg, bg,
+	rop, planemask);
+}
+
+/*
+ * Depth 15 without the MBX. fb would set the alpha bit through the wfb
+ * accessors, one indirect call per word; these hooks write whole spans
+ * instead, see VERMILIONFillSpan15() and tests/span15.c. Everything else,
+ * Render included, still goes through wfb.
+ */
+
+#define CPU_SCANLINE(_pVermilion, _x, _y) \
+    ((CARD16 *) ((char *)(_pVermilion)->fbMap + \
+	(_y) * (_pVermilion)->stride) + (_x))
+
+static void
+cpuSync(ScrnInfoPtr pScrn)
+{
+}
+
+static void
+cpuSetupForSolidFill15(ScrnInfoRec * pScrn, int color, int rop,
+    unsigned int planemask)
+{
+    VERMILIONPTR(pScrn)->fillColour = color;
+}
+
+static void
+cpuSubsequentSolidFillRect15(ScrnInfoRec * pScrn, int x, int y, int w,
+    int h)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    while (h--) {
+	VERMILIONFillSpan15(CPU_SCANLINE(pVermilion, x, y), w,
+	    pVermilion->fillColour);
+	y++;
+    }
+}
+
+static void
+cpuSubsequentSolidHorVertLine15(ScrnInfoRec * pScrn, int x, int y, int len,
+    int dir)
+{
+    if (dir == DEGREES_0)
+	cpuSubsequentSolidFillRect15(pScrn, x, y, len, 1);
+    else
+	cpuSubsequentSolidFillRect15(pScrn, x, y, 1, len);
+}
+
+static void
+cpuSetupForScreenToScreenCopy15(ScrnInfoRec * pScrn, int xdir, int ydir,
+    int rop, unsigned int planemask, int transparency_color)
+{
+    VERMILIONPTR(pScrn)->cpuYDir = ydir;
+}
+
+/*
+ * The alpha bit is already set in the framebuffer, so copies don't need
+ * to touch it.
+ */
+static void
+cpuSubsequentScreenToScreenCopy15(ScrnInfoRec * pScrn, int x1, int y1,
+    int x2, int y2, int w, int h)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    VERMILIONCPUCopy(pScrn, pVermilion->fbMap, pVermilion->stride,
+	pVermilion->fbMap, pVermilion->stride, x1, y1, x2, y2, w, h,
+	pVermilion->cpuYDir);
+}
+
+/*
+ * Core text and stipples. XAA fills hostScanline with a scanline of LSB
+ * first bits and this expands it straight into the framebuffer.
+ */
+
+static void
+cpuSetupForScanlineCPUToScreenColorExpandFill15(ScrnInfoRec * pScrn,
+    int fg, int bg, int rop, unsigned int planemask)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->cpuFg = fg;
+    pVermilion->cpuBg = bg;
+}
+
+static void
+cpuSubsequentScanlineCPUToScreenColorExpandFill15(ScrnInfoRec * pScrn,
+    int x, int y, int w, int h, int skipleft)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    pVermilion->cpuX = x;
+    pVermilion->cpuY = y;
+    pVermilion->cpuW = w;
+    pVermilion->cpuSkip = skipleft;
+}
+
+static void
+cpuSubsequentColorExpandScanline15(ScrnInfoRec * pScrn, int bufno)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    VERMILIONExpandSpan15(CPU_SCANLINE(pVermilion, pVermilion->cpuX,
+	    pVermilion->cpuY), (CARD8 *) pVermilion->hostScanline,
+	pVermilion->cpuSkip, pVermilion->cpuW, pVermilion->cpuFg,
+	pVermilion->cpuBg);
+    pVermilion->cpuY++;
+}
+
+static void
+cpuWritePixmap15(ScrnInfoRec * pScrn, int x, int y, int w, int h,
+    unsigned char *src, int srcwidth, int rop, unsigned int planemask,
+    int transparency_color, int bpp, int depth)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    while (h--) {
+	VERMILIONWriteSpan15(CPU_SCANLINE(pVermilion, x, y),
+	    (CARD16 *) src, w);
+	src += srcwidth;
+	y++;
+    }
+}
+
+static void
+cpuWriteBitmap15(ScrnInfoRec * pScrn, int x, int y, int w, int h,
+    unsigned char *src, int srcwidth, int skipleft, int fg, int bg,
+    int rop, unsigned int planemask)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    while (h--) {
+	VERMILIONExpandSpan15(CPU_SCANLINE(pVermilion, x, y), src, skipleft,
+	    w, fg, bg);
+	src += srcwidth;
+	y++;
+    }
+}
+
+/*
+ * XAA with the CPU hooks above, for depth 15 with Accel off. Nothing is
+ * kept offscreen: copying out of VRAM costs the CPU about as much as
+ * drawing again.
+ */
+
+Bool
+VERMILIONAccelInitCPU15(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    XAAInfoRecPtr infoPtr;
+
+    pVermilion->accel = infoPtr = XAACreateInfoRec();
+    if (!infoPtr)
+	return FALSE;
+
+    infoPtr->Flags = LINEAR_FRAMEBUFFER;
+
+    infoPtr->Sync = cpuSync;
+
+    infoPtr->SolidFillFlags = GXCOPY_ONLY | NO_PLANEMASK;
+    infoPtr->SetupForSolidFill = cpuSetupForSolidFill15;
+    infoPtr->SubsequentSolidFillRect = cpuSubsequentSolidFillRect15;
+
+    infoPtr->SolidLineFlags = GXCOPY_ONLY | NO_PLANEMASK;
+    infoPtr->SetupForSolidLine = cpuSetupForSolidFill15;
+    infoPtr->SubsequentSolidHorVertLine = cpuSubsequentSolidHorVertLine15;
+
+    infoPtr->ScreenToScreenCopyFlags = GXCOPY_ONLY | NO_PLANEMASK |
+	NO_TRANSPARENCY;
+    infoPtr->SetupForScreenToScreenCopy = cpuSetupForScreenToScreenCopy15;
+    infoPtr->SubsequentScreenToScreenCopy =
+	cpuSubsequentScreenToScreenCopy15;
+
+    pVermilion->hostBuffers[0] = (unsigned char *)pVermilion->hostScanline;
+    infoPtr->ScanlineCPUToScreenColorExpandFillFlags = GXCOPY_ONLY |
+	NO_PLANEMASK | CPU_TRANSFER_PAD_DWORD | SCANLINE_PAD_DWORD |
+	LEFT_EDGE_CLIPPING;
+    infoPtr->NumScanlineColorExpandBuffers = 1;
+    infoPtr->ScanlineColorExpandBuffers = pVermilion->hostBuffers;
+    infoPtr->SetupForScanlineCPUToScreenColorExpandFill =
+	cpuSetupForScanlineCPUToScreenColorExpandFill15;
+    infoPtr->SubsequentScanlineCPUToScreenColorExpandFill =
+	cpuSubsequentScanlineCPUToScreenColorExpandFill15;
+    infoPtr->SubsequentColorExpandScanline =
+	cpuSubsequentColorExpandScanline15;
+
+    infoPtr->WritePixmapFlags = GXCOPY_ONLY | NO_PLANEMASK | NO_TRANSPARENCY;
+    infoPtr->WritePixmap = cpuWritePixmap15;
+
+    infoPtr->WriteBitmapFlags = GXCOPY_ONLY | NO_PLANEMASK;
+    infoPtr->WriteBitmap = cpuWriteBitmap15;
+
+    return XAAInit(pScreen, infoPtr);
+}
+
+/*
+ * Wait for whichever acceleration architecture is active to go idle.
+ */
+
+void
+VERMILIONAccelSync(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    if (pVermilion->accel)
+	(*pVermilion->accel->Sync) (pScrn);
+    else if (pVermilion->exa)
+	exaWaitSync(pScrn->pScreen);
+}
+
+void
+VERMILIONAccelFini(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    int i;
+
+    VERMILIONAccelSync(pScrn);
+
+    if (pVermilion->accel) {
+	XAADestroyInfoRec(pVermilion->accel);
+	pVermilion->accel = NULL;
+    }
+
+    if (pVermilion->exa) {
+	exaDriverFini(pScreen);
+	xfree(pVermilion->exa);
+	pVermilion->exa = NULL;
+    }
+
+    for (i = 0; i < pVermilion->numPools; i++) {
+	VERMILIONHeapPtr heap = pVermilion->pools[i].heap;
+	VERMILIONHeapStatsRec stats;
+
+	VERMILIONHeapGetStats(heap, &stats);
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Heap %d: %lu allocations, %lu frees, %lu evictions, "
+	    "%lu failed.\n", i, stats.allocs, stats.frees, stats.evictions,
+	    stats.failures);
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Heap %d: %lu kB in %lu blocks, peak %lu kB, %lu free blocks, "
+	    "largest %lu kB.\n", i, stats.bytesUsed / 1024, stats.usedBlocks,
+	    stats.bytesPeak / 1024, stats.freeBlocks,
+	    stats.largestFree / 1024);
+
+	VERMILIONHeapDestroy(heap);
+	pVermilion->pools[i].heap = NULL;
+    }
+    pVermilion->numPools = 0;
 }
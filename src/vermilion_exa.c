@@ -0,0 +1,729 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mi.h"
+
+#include "vermilion.h"
+#include "vermilion_mbx.h"
+
+/*
+ * EXA acceleration, selected with Option "AccelMethod" "EXA". Uses the same
+ * MBX 2D blits as the XAA hooks in vermilion_accel.c.
+ *
+ * VRAM layout:
+ *
+ *   0                  front buffer, virtualY * stride
+ *   offScreenBase      EXA offscreen pixmaps
+ *   fbSize - MBX_SYNC_MAP_SIZE  MBX fence slots, palettes and patterns
+ *
+ * With EXA 2.5 and later the driver allocates the pixmaps itself, from
+ * vermilion_heap.c heaps over the offscreen range and over any VRAM
+ * chunks the kernel reports beyond it. Each pixmap gets its own pitch,
+ * and when all of VRAM is taken the least recently used pixmaps are
+ * copied out to system memory, where they stay until they're destroyed.
+ */
+
+#if EXA_VERSION_MAJOR > 2 || (EXA_VERSION_MAJOR == 2 && EXA_VERSION_MINOR >= 5)
+#define VERMILION_EXA_PIXMAPS
+#endif
+
+#ifdef VERMILION_EXA_PIXMAPS
+typedef struct _VERMILIONExaPixmap
+{
+    PixmapPtr pPixmap;
+    VERMILIONPoolPtr pool;
+    VERMILIONHeapBlockPtr block;       /* NULL when not in VRAM */
+    void *sys;
+    unsigned long pitch;
+    unsigned long size;
+    int pins;
+    Bool screen;
+} VERMILIONExaPixmapRec, *VERMILIONExaPixmapPtr;
+#endif
+
+/* X11 alu to ROP3 with a source operand */
+static const CARD8 mbxExaCopyRop[16] = {
+    0x00, 0x88, 0x44, 0xCC, 0x22, 0xAA, 0x66, 0xEE,
+    0x11, 0x99, 0x55, 0xDD, 0x33, 0xBB, 0x77, 0xFF
+};
+
+/* X11 alu to ROP3 with a pattern operand */
+static const CARD8 mbxExaPatternRop[16] = {
+    0x00, 0xA0, 0x50, 0xF0, 0x0A, 0xAA, 0x5A, 0xFA,
+    0x05, 0xA5, 0x55, 0xF5, 0x0F, 0xAF, 0x5F, 0xFF
+};
+
+#define MBX_EXA_PIXMAP_ALIGN 32
+
+/*
+ * Pixmap offsets are from mbxFBDevAddr in the MBX's address space, which
+ * for pixmaps in other VRAM chunks may wrap around.
+ */
+
+static unsigned long
+mbxExaPixmapOffset(VERMILIONPtr pVermilion, PixmapPtr pPixmap)
+{
+#ifdef VERMILION_EXA_PIXMAPS
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    /* The screen pixmap is at 0 */
+    if (!priv || !priv->block)
+	return 0;
+
+    return (CARD32) (priv->pool->devAddr + priv->block->offset -
+	pVermilion->mbxFBDevAddr);
+#else
+    return exaGetPixmapOffset(pPixmap);
+#endif
+}
+
+static CARD8 *
+mbxExaPixmapMap(VERMILIONPtr pVermilion, PixmapPtr pPixmap)
+{
+#ifdef VERMILION_EXA_PIXMAPS
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    if (!priv || !priv->block)
+	return pVermilion->fbMap;
+
+    return priv->pool->map + priv->block->offset;
+#else
+    return (CARD8 *) pVermilion->fbMap + exaGetPixmapOffset(pPixmap);
+#endif
+}
+
+/*
+ * Evicted pixmaps, and those that never fit, aren't the MBX's to touch.
+ */
+
+static Bool
+mbxExaPixmapInVRAM(PixmapPtr pPixmap)
+{
+#ifdef VERMILION_EXA_PIXMAPS
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    return priv && (priv->block || priv->screen);
+#else
+    return TRUE;
+#endif
+}
+
+static CARD32
+mbxExaPixmapAddr(VERMILIONPtr pVermilion, PixmapPtr pPixmap)
+{
+    return pVermilion->mbxFBDevAddr +
+	mbxExaPixmapOffset(pVermilion, pPixmap);
+}
+
+/*
+ * Keep pixmaps the MBX uses at the far end of the heap's eviction order.
+ */
+
+static void
+mbxExaTouch(VERMILIONPtr pVermilion, PixmapPtr pPixmap)
+{
+#ifdef VERMILION_EXA_PIXMAPS
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    if (priv && priv->block && priv->pool->heap)
+	VERMILIONHeapTouch(priv->pool->heap, priv->block);
+#endif
+}
+
+/*
+ * The pixmap's entry in the surface table, see VERMILIONMBXSurface().
+ */
+
+static VERMILIONSurfacePtr
+mbxExaSurface(VERMILIONPtr pVermilion, PixmapPtr pPixmap)
+{
+    return VERMILIONMBXSurface(pVermilion,
+	mbxExaPixmapOffset(pVermilion, pPixmap));
+}
+
+/*
+ * Wait until the CPU may read (write == FALSE) or write the pixmap.
+ */
+
+static void
+mbxExaWaitSurface(ScrnInfoPtr pScrn, PixmapPtr pPixmap, Bool write)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONSurfacePtr surf = mbxExaSurface(pVermilion, pPixmap);
+
+    VERMILIONMBXWaitSeq(pScrn, surf->lastWrite);
+    if (write)
+	VERMILIONMBXWaitSeq(pScrn, surf->lastRead);
+}
+
+static Bool
+mbxExaPrepareSolid(PixmapPtr pPixmap, int alu, Pixel planemask, Pixel fg)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pPixmap->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    if (!EXA_PM_IS_SOLID(&pPixmap->drawable, planemask))
+	return FALSE;
+    if (pPixmap->drawable.bitsPerPixel != pScrn->bitsPerPixel)
+	return FALSE;
+    if (!mbxExaPixmapInVRAM(pPixmap))
+	return FALSE;
+
+    pVermilion->ROP = mbxExaPatternRop[alu];
+    pVermilion->cpuOK = (alu == GXcopy);
+    pVermilion->fillColour = fg;
+    pVermilion->exaDst = mbxExaSurface(pVermilion, pPixmap);
+    mbxExaTouch(pVermilion, pPixmap);
+
+    return TRUE;
+}
+
+static void
+mbxExaSolid(PixmapPtr pPixmap, int x1, int y1, int x2, int y2)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pPixmap->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONSurfacePtr dst = pVermilion->exaDst;
+    CARD32 auBltPacket[5];
+
+    /* See VERMILIONCPUFill(). Only this pixmap's blits need to be done. */
+    if (pVermilion->cpuOK &&
+	(x2 - x1) * (y2 - y1) <= pVermilion->cpuFillMax &&
+	VERMILIONMBXSeqRetired(pScrn, dst->lastWrite) &&
+	VERMILIONMBXSeqRetired(pScrn, dst->lastRead)) {
+	VERMILIONCPUFill(pScrn, mbxExaPixmapMap(pVermilion, pPixmap),
+	    exaGetPixmapPitch(pPixmap), x1, y1, x2 - x1, y2 - y1,
+	    pVermilion->fillColour);
+	return;
+    }
+
+    MBXSetDstSurface(pVermilion, pVermilion->mbxBpp |
+	exaGetPixmapPitch(pPixmap), mbxExaPixmapAddr(pVermilion, pPixmap));
+
+    WAITFIFO(5);
+
+    auBltPacket[0] = MBX2D_BLIT_BH |
+	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
+    auBltPacket[1] = pVermilion->fillColour;
+    auBltPacket[2] = (x1 & 0xffff) << 16 | (y1 & 0xffff);
+    auBltPacket[3] = (x2 & 0xffff) << 16 | (y2 & 0xffff);
+    auBltPacket[4] = MBX2D_FENCE_BH;
+    WRITESLAVEPORTDATA(5);
+
+    dst->lastWrite = VERMILIONMBXPendingSeq(pScrn);
+}
+
+static void
+mbxExaDone(PixmapPtr pPixmap)
+{
+}
+
+static Bool
+mbxExaPrepareCopy(PixmapPtr pSrc, PixmapPtr pDst, int xdir, int ydir,
+    int alu, Pixel planemask)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pDst->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    if (!EXA_PM_IS_SOLID(&pDst->drawable, planemask))
+	return FALSE;
+    if (pSrc->drawable.bitsPerPixel != pScrn->bitsPerPixel ||
+	pDst->drawable.bitsPerPixel != pScrn->bitsPerPixel)
+	return FALSE;
+    if (!mbxExaPixmapInVRAM(pSrc) || !mbxExaPixmapInVRAM(pDst))
+	return FALSE;
+
+    pVermilion->ROP = mbxExaCopyRop[alu];
+    pVermilion->cpuOK = (alu == GXcopy);
+    pVermilion->exaSrcPixmap = pSrc;
+    pVermilion->exaSrc = mbxExaSurface(pVermilion, pSrc);
+    pVermilion->exaDst = mbxExaSurface(pVermilion, pDst);
+    mbxExaTouch(pVermilion, pSrc);
+    mbxExaTouch(pVermilion, pDst);
+
+    pVermilion->dir = MBX2D_TEXTCOPY_TL2BR;
+    if (xdir < 0)
+	pVermilion->dir |= MBX2D_TEXTCOPY_TR2BL;
+    if (ydir < 0)
+	pVermilion->dir |= MBX2D_TEXTCOPY_BL2TR;
+
+    return TRUE;
+}
+
+static void
+mbxExaCopy(PixmapPtr pDst, int srcX, int srcY, int dstX, int dstY,
+    int w, int h)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pDst->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    PixmapPtr pSrc = pVermilion->exaSrcPixmap;
+    VERMILIONSurfacePtr src = pVermilion->exaSrc;
+    VERMILIONSurfacePtr dst = pVermilion->exaDst;
+    CARD32 auBltPacket[5];
+
+    if (pVermilion->cpuOK && w * h <= pVermilion->cpuCopyMax &&
+	VERMILIONMBXSeqRetired(pScrn, src->lastWrite) &&
+	VERMILIONMBXSeqRetired(pScrn, dst->lastWrite) &&
+	VERMILIONMBXSeqRetired(pScrn, dst->lastRead)) {
+	VERMILIONCPUCopy(pScrn, mbxExaPixmapMap(pVermilion, pSrc),
+	    exaGetPixmapPitch(pSrc), mbxExaPixmapMap(pVermilion, pDst),
+	    exaGetPixmapPitch(pDst), srcX, srcY, dstX, dstY, w, h,
+	    (pVermilion->dir & MBX2D_TEXTCOPY_BL2TR) ? -1 : 1);
+	return;
+    }
+
+    MBXSetSrcSurface(pVermilion, MBX2D_SRC_FBMEM | pVermilion->mbxBpp |
+	exaGetPixmapPitch(pSrc), mbxExaPixmapAddr(pVermilion, pSrc));
+    MBXSetDstSurface(pVermilion, pVermilion->mbxBpp |
+	exaGetPixmapPitch(pDst), mbxExaPixmapAddr(pVermilion, pDst));
+
+    WAITFIFO(5);
+
+    auBltPacket[0] = MBX2D_SRC_OFF_BH | (srcX & 0xffff) << 14 |
+	(srcY & 0xffff);
+    auBltPacket[1] = MBX2D_BLIT_BH | MBX2D_USE_PAT | pVermilion->dir |
+	(pVermilion->ROP & 0xff) << 8 | (pVermilion->ROP & 0xff);
+    auBltPacket[2] = (dstX & 0xffff) << 16 | (dstY & 0xffff);
+    auBltPacket[3] = ((dstX + w) & 0xffff) << 16 | ((dstY + h) & 0xffff);
+    auBltPacket[4] = MBX2D_FENCE_BH;
+
+    WRITESLAVEPORTDATA(5);
+
+    src->lastRead = VERMILIONMBXPendingSeq(pScrn);
+    dst->lastWrite = src->lastRead;
+}
+
+static Bool
+mbxExaUploadToScreen(PixmapPtr pDst, int x, int y, int w, int h,
+    char *src, int src_pitch)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pDst->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    int cpp = pDst->drawable.bitsPerPixel >> 3;
+    int pitch = exaGetPixmapPitch(pDst);
+    VERMILIONSurfacePtr surf;
+    char *dst;
+
+    if (!mbxExaPixmapInVRAM(pDst))
+	return FALSE;
+
+    surf = mbxExaSurface(pVermilion, pDst);
+    mbxExaTouch(pVermilion, pDst);
+
+    /*
+     * Rather than wait for a busy pixmap, queue the upload behind the
+     * blits that use it.
+     */
+    if (pDst->drawable.bitsPerPixel == pScrn->bitsPerPixel &&
+	(!VERMILIONMBXSeqRetired(pScrn, surf->lastWrite) ||
+	    !VERMILIONMBXSeqRetired(pScrn, surf->lastRead))) {
+	VERMILIONMBXWriteImage(pScrn, mbxExaPixmapAddr(pVermilion, pDst),
+	    pitch, x, y, w, h, (const CARD8 *)src, src_pitch);
+	surf->lastWrite = VERMILIONMBXPendingSeq(pScrn);
+	return TRUE;
+    }
+
+    dst = (char *)mbxExaPixmapMap(pVermilion, pDst) +
+	y * pitch + x * cpp;
+
+    mbxExaWaitSurface(pScrn, pDst, TRUE);
+
+    while (h--) {
+	memcpy(dst, src, w * cpp);
+	src += src_pitch;
+	dst += pitch;
+    }
+
+    return TRUE;
+}
+
+static Bool
+mbxExaDownloadFromScreen(PixmapPtr pSrc, int x, int y, int w, int h,
+    char *dst, int dst_pitch)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pSrc->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    int cpp = pSrc->drawable.bitsPerPixel >> 3;
+    int pitch = exaGetPixmapPitch(pSrc);
+    char *src;
+
+    if (!mbxExaPixmapInVRAM(pSrc))
+	return FALSE;
+
+    mbxExaTouch(pVermilion, pSrc);
+
+    src = (char *)mbxExaPixmapMap(pVermilion, pSrc) +
+	y * pitch + x * cpp;
+
+    mbxExaWaitSurface(pScrn, pSrc, FALSE);
+
+    while (h--) {
+	memcpy(dst, src, w * cpp);
+	src += pitch;
+	dst += dst_pitch;
+    }
+
+    return TRUE;
+}
+
+#ifdef VERMILION_EXA_PIXMAPS
+
+/*
+ * Driver allocated pixmaps. Pixmaps at the screen depth go in the first
+ * pool with room, with a pitch aligned for the MBX. Only when none has
+ * room are pixmaps evicted, starting with the framebuffer's own pool.
+ * Everything else, and whatever still doesn't fit, lives in system memory
+ * and is left to fb.
+ */
+
+static void *
+mbxExaCreatePixmap(ScreenPtr pScreen, int width, int height, int depth,
+    int usage_hint, int bitsPerPixel, int *new_fb_pitch)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONExaPixmapPtr priv;
+    VERMILIONPoolPtr pool;
+    unsigned long pitch;
+    int evict, i;
+
+    priv = xcalloc(1, sizeof(*priv));
+    if (!priv)
+	return NULL;
+
+    /* The screen pixmap, or a header for memory set up later */
+    if (!width || !height)
+	return priv;
+
+    if (bitsPerPixel == pScrn->bitsPerPixel &&
+	width <= pVermilion->exa->maxX && height <= pVermilion->exa->maxY) {
+	for (evict = 0; evict < 2 && !priv->block; evict++) {
+	    for (i = 0; i < pVermilion->numPools && !priv->block; i++) {
+		pool = &pVermilion->pools[i];
+		priv->block = VERMILIONHeapAllocSurface(pool->heap,
+		    (width * bitsPerPixel + 7) / 8, height,
+		    MBX_EXA_PIXMAP_ALIGN, &pitch, priv, evict);
+		priv->pool = pool;
+	    }
+	}
+    }
+
+    if (!priv->block) {
+	pitch = ((width * bitsPerPixel + 31) >> 5) * 4;
+	priv->sys = xalloc(pitch * height);
+	if (!priv->sys) {
+	    xfree(priv);
+	    return NULL;
+	}
+    }
+
+    priv->pitch = pitch;
+    priv->size = pitch * height;
+    *new_fb_pitch = pitch;
+
+    return priv;
+}
+
+/*
+ * Forget a pixmap's VRAM. Its sequence numbers go to surfaceFloor, so
+ * that whatever is allocated over it next waits for its blits.
+ */
+
+static void
+mbxExaReleaseBlock(VERMILIONPtr pVermilion, VERMILIONExaPixmapPtr priv)
+{
+    unsigned long offset = (CARD32) (priv->pool->devAddr +
+	priv->block->offset - pVermilion->mbxFBDevAddr);
+    VERMILIONSurfacePtr surf = VERMILIONMBXSurfaceSlot(pVermilion, offset);
+
+    if (surf->valid && surf->offset == offset)
+	VERMILIONMBXSurfaceRetire(pVermilion, surf);
+
+    priv->block = NULL;
+}
+
+static void
+mbxExaDestroyPixmap(ScreenPtr pScreen, void *driverPriv)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(xf86Screens[pScreen->myNum]);
+    VERMILIONExaPixmapPtr priv = driverPriv;
+    VERMILIONHeapBlockPtr block;
+
+    if (!priv)
+	return;
+
+    /* Once the heap is gone, so are the blocks. */
+    if (priv->block && priv->pool->heap) {
+	block = priv->block;
+	mbxExaReleaseBlock(pVermilion, priv);
+	VERMILIONHeapFree(priv->pool->heap, block);
+    }
+
+    xfree(priv->sys);
+    xfree(priv);
+}
+
+/*
+ * A heap wants the VRAM of an idle pixmap back. Copy it out once the MBX
+ * has finished writing it, then have EXA pick up the new pointer through
+ * ModifyPixmapHeader: it keeps its own copy of the pointer for pixmaps
+ * that aren't offscreen, and no longer calls PrepareAccess for this one.
+ */
+
+static int
+mbxExaEvict(void *closure, void *owner)
+{
+    ScrnInfoPtr pScrn = closure;
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONExaPixmapPtr priv = owner;
+    VERMILIONSurfacePtr surf;
+    unsigned long offset;
+    void *sys;
+
+    sys = xalloc(priv->size);
+    if (!sys)
+	return FALSE;
+
+    offset = (CARD32) (priv->pool->devAddr + priv->block->offset -
+	pVermilion->mbxFBDevAddr);
+    surf = VERMILIONMBXSurfaceSlot(pVermilion, offset);
+    if (surf->valid && surf->offset == offset)
+	VERMILIONMBXWaitSeq(pScrn, surf->lastWrite);
+    else
+	VERMILIONMBXWaitSeq(pScrn, pVermilion->surfaceFloor);
+
+    memcpy(sys, priv->pool->map + priv->block->offset, priv->size);
+
+    mbxExaReleaseBlock(pVermilion, priv);
+    priv->sys = sys;
+    if (priv->pPixmap) {
+	ScreenPtr pScreen = priv->pPixmap->drawable.pScreen;
+
+	(*pScreen->ModifyPixmapHeader) (priv->pPixmap, 0, 0, 0, 0,
+	    priv->pitch, NULL);
+    }
+
+    return TRUE;
+}
+
+static Bool
+mbxExaModifyPixmapHeader(PixmapPtr pPixmap, int width, int height,
+    int depth, int bitsPerPixel, int devKind, pointer pPixData)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pPixmap->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    if (!priv)
+	return FALSE;
+
+    priv->pPixmap = pPixmap;
+
+    if (!pPixData) {
+	if (priv->block)
+	    pPixData = priv->pool->map + priv->block->offset;
+	else
+	    pPixData = priv->sys;
+    }
+
+    priv->screen = (pPixData == pVermilion->fbMap);
+
+    return miModifyPixmapHeader(pPixmap, width, height, depth,
+	bitsPerPixel, devKind, pPixData);
+}
+
+static Bool
+mbxExaPixmapIsOffscreen(PixmapPtr pPixmap)
+{
+    return mbxExaPixmapInVRAM(pPixmap);
+}
+
+/*
+ * EXA has already waited for the MBX. Point the pixmap at wherever it
+ * lives now, rather than at what EXA last saw, and keep it there while
+ * the CPU has it.
+ */
+
+static Bool
+mbxExaPrepareAccess(PixmapPtr pPixmap, int index)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pPixmap->drawable.pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    if (!priv)
+	return TRUE;
+
+    if (priv->block) {
+	pPixmap->devPrivate.ptr = priv->pool->map + priv->block->offset;
+	pPixmap->devKind = priv->pitch;
+    } else if (priv->screen) {
+	pPixmap->devPrivate.ptr = pVermilion->fbMap;
+    } else if (priv->sys) {
+	pPixmap->devPrivate.ptr = priv->sys;
+	pPixmap->devKind = priv->pitch;
+    }
+
+    if (priv->block && priv->pool->heap) {
+	VERMILIONHeapPin(priv->pool->heap, priv->block);
+	priv->pins++;
+    }
+
+    return TRUE;
+}
+
+static void
+mbxExaFinishAccess(PixmapPtr pPixmap, int index)
+{
+    VERMILIONExaPixmapPtr priv = exaGetPixmapDriverPrivate(pPixmap);
+
+    if (priv && priv->block && priv->pins && priv->pool->heap) {
+	VERMILIONHeapUnpin(priv->pool->heap, priv->block);
+	priv->pins--;
+    }
+}
+
+static void
+mbxExaInitPools(ScrnInfoPtr pScrn, ExaDriverPtr exa)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONPoolPtr pool;
+    int i;
+
+    pVermilion->numPools = VERMILIONVRAMInitPools(pVermilion->pools,
+	pVermilion->fbMap, pVermilion->mbxFBDevAddr, exa->offScreenBase,
+	exa->memorySize, pVermilion->vramChunks, pVermilion->numVRAMChunks,
+	MBX_EXA_PIXMAP_ALIGN, mbxExaEvict, pScrn);
+
+    for (i = 0; i < pVermilion->numPools; i++) {
+	pool = &pVermilion->pools[i];
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "EXA: %lu kB for pixmaps at 0x%08lx.\n",
+	    pool->heap->size / 1024,
+	    (unsigned long)(pool->devAddr + pool->heap->offset));
+    }
+}
+
+#endif /* VERMILION_EXA_PIXMAPS */
+
+/*
+ * EXA markers are MBX sequence numbers.
+ */
+
+static int
+mbxExaMarkSync(ScreenPtr pScreen)
+{
+    return (int)VERMILIONMBXEmitSeq(xf86Screens[pScreen->myNum]);
+}
+
+static void
+mbxExaWaitMarker(ScreenPtr pScreen, int marker)
+{
+    VERMILIONMBXWaitSeq(xf86Screens[pScreen->myNum], (CARD32)marker);
+}
+
+Bool
+VERMILIONExaInit(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    ExaDriverPtr exa;
+
+    if (!VERMILIONMBXInit(pScrn))
+	return FALSE;
+
+    pVermilion->exa = exa = exaDriverAlloc();
+    if (!exa)
+	return FALSE;
+
+    exa->exa_major = EXA_VERSION_MAJOR;
+    exa->exa_minor = EXA_VERSION_MINOR;
+
+    exa->memoryBase = pVermilion->fbMap;
+    exa->offScreenBase = ALIGN_TO(pScrn->virtualY * pVermilion->stride,
+	MBX_EXA_PIXMAP_ALIGN);
+    exa->memorySize = pVermilion->fbSize - MBX_SYNC_MAP_SIZE;
+
+    exa->pixmapOffsetAlign = MBX_EXA_PIXMAP_ALIGN;
+    exa->pixmapPitchAlign = MBX_EXA_PIXMAP_ALIGN;
+    exa->flags = EXA_OFFSCREEN_PIXMAPS;
+    exa->maxX = MBX_MAX_COORD;
+    exa->maxY = MBX_MAX_COORD;
+
+    exa->PrepareSolid = mbxExaPrepareSolid;
+    exa->Solid = mbxExaSolid;
+    exa->DoneSolid = mbxExaDone;
+
+    exa->PrepareCopy = mbxExaPrepareCopy;
+    exa->Copy = mbxExaCopy;
+    exa->DoneCopy = mbxExaDone;
+
+    exa->UploadToScreen = mbxExaUploadToScreen;
+    exa->DownloadFromScreen = mbxExaDownloadFromScreen;
+
+    exa->MarkSync = mbxExaMarkSync;
+    exa->WaitMarker = mbxExaWaitMarker;
+
+#ifdef VERMILION_EXA_PIXMAPS
+    mbxExaInitPools(pScrn, exa);
+
+    exa->flags |= EXA_HANDLES_PIXMAPS;
+    exa->CreatePixmap2 = mbxExaCreatePixmap;
+    exa->DestroyPixmap = mbxExaDestroyPixmap;
+    exa->ModifyPixmapHeader = mbxExaModifyPixmapHeader;
+    exa->PixmapIsOffscreen = mbxExaPixmapIsOffscreen;
+    exa->PrepareAccess = mbxExaPrepareAccess;
+    exa->FinishAccess = mbxExaFinishAccess;
+#endif
+
+    if (!exaDriverInit(pScreen, exa)) {
+#ifdef VERMILION_EXA_PIXMAPS
+	while (pVermilion->numPools > 0) {
+	    pVermilion->numPools--;
+	    VERMILIONHeapDestroy(pVermilion->pools[pVermilion->numPools].heap);
+	    pVermilion->pools[pVermilion->numPools].heap = NULL;
+	}
+#endif
+	xfree(exa);
+	pVermilion->exa = NULL;
+	return FALSE;
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"EXA: %lu kB of offscreen memory for pixmaps.\n",
+	(exa->memorySize - exa->offScreenBase) / 1024);
+
+    VERMILIONMBXCalibrate(pScrn);
+
+    return TRUE;
+}
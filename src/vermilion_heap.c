@@ -0,0 +1,372 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include "vermilion_heap.h"
+
+/*
+ * Offscreen VRAM heap. Every block, free or not, is on a list in address
+ * order so that freed blocks can be merged with their neighbours. Free
+ * blocks are also on a free list by size class, and a request is served
+ * first fit from the smallest class that can hold it, splitting off the
+ * rest. Allocated blocks that aren't pinned are kept in least recently
+ * used order, and when nothing fits the least recently used ones are
+ * handed back to their owners until something does.
+ */
+
+static int
+heapClass(VERMILIONHeapPtr heap, unsigned long size)
+{
+    unsigned long units = size / heap->align;
+    int c = 0;
+
+    while (units > 1 && c < VERMILION_HEAP_CLASSES - 1) {
+	units >>= 1;
+	c++;
+    }
+
+    return c;
+}
+
+static void
+heapLinkFree(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    VERMILIONHeapBlockPtr *list = &heap->freeLists[heapClass(heap,
+	    block->size)];
+
+    block->linkPrev = NULL;
+    block->linkNext = *list;
+    if (*list)
+	(*list)->linkPrev = block;
+    *list = block;
+}
+
+static void
+heapUnlinkFree(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (block->linkPrev)
+	block->linkPrev->linkNext = block->linkNext;
+    else
+	heap->freeLists[heapClass(heap, block->size)] = block->linkNext;
+    if (block->linkNext)
+	block->linkNext->linkPrev = block->linkPrev;
+}
+
+static void
+heapLinkLRU(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    block->linkPrev = NULL;
+    block->linkNext = heap->lruHead;
+    if (heap->lruHead)
+	heap->lruHead->linkPrev = block;
+    else
+	heap->lruTail = block;
+    heap->lruHead = block;
+}
+
+static void
+heapUnlinkLRU(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (block->linkPrev)
+	block->linkPrev->linkNext = block->linkNext;
+    else
+	heap->lruHead = block->linkNext;
+    if (block->linkNext)
+	block->linkNext->linkPrev = block->linkPrev;
+    else
+	heap->lruTail = block->linkPrev;
+}
+
+static VERMILIONHeapBlockPtr
+heapFind(VERMILIONHeapPtr heap, unsigned long size)
+{
+    VERMILIONHeapBlockPtr block;
+    int c;
+
+    for (c = heapClass(heap, size); c < VERMILION_HEAP_CLASSES; c++) {
+	for (block = heap->freeLists[c]; block; block = block->linkNext)
+	    if (block->size >= size)
+		return block;
+    }
+
+    return NULL;
+}
+
+/*
+ * Unlink a block from the address list and free its record.
+ */
+
+static void
+heapRemove(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (block->prev)
+	block->prev->next = block->next;
+    else
+	heap->blocks = block->next;
+    if (block->next)
+	block->next->prev = block->prev;
+    free(block);
+}
+
+/*
+ * Return an allocated block, which is no longer on the LRU list, to the
+ * free lists, merged with any free neighbours.
+ */
+
+static void
+heapRelease(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    VERMILIONHeapBlockPtr neighbour;
+
+    heap->stats.bytesUsed -= block->size;
+    heap->stats.usedBlocks--;
+    block->owner = NULL;
+    block->pinned = 0;
+
+    neighbour = block->next;
+    if (neighbour && !neighbour->owner) {
+	heapUnlinkFree(heap, neighbour);
+	block->size += neighbour->size;
+	heapRemove(heap, neighbour);
+    }
+
+    neighbour = block->prev;
+    if (neighbour && !neighbour->owner) {
+	heapUnlinkFree(heap, neighbour);
+	neighbour->size += block->size;
+	heapRemove(heap, block);
+	block = neighbour;
+    }
+
+    heapLinkFree(heap, block);
+}
+
+/*
+ * Evict the least recently used block whose owner lets go of it.
+ */
+
+static int
+heapEvict(VERMILIONHeapPtr heap)
+{
+    VERMILIONHeapBlockPtr block;
+
+    if (!heap->evict)
+	return 0;
+
+    for (block = heap->lruTail; block; block = block->linkPrev) {
+	if ((*heap->evict) (heap->closure, block->owner)) {
+	    heapUnlinkLRU(heap, block);
+	    heapRelease(heap, block);
+	    heap->stats.frees++;
+	    heap->stats.evictions++;
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+VERMILIONHeapPtr
+VERMILIONHeapCreate(unsigned long offset, unsigned long size,
+    unsigned long align, VERMILIONHeapEvictProc evict, void *closure)
+{
+    VERMILIONHeapPtr heap;
+    VERMILIONHeapBlockPtr block;
+    unsigned long start;
+
+    start = (offset + align - 1) / align * align;
+    if (start >= offset + size)
+	return NULL;
+    size = (offset + size - start) / align * align;
+    if (!size)
+	return NULL;
+
+    heap = calloc(1, sizeof(*heap));
+    block = calloc(1, sizeof(*block));
+    if (!heap || !block) {
+	free(heap);
+	free(block);
+	return NULL;
+    }
+
+    heap->offset = start;
+    heap->size = size;
+    heap->align = align;
+    heap->evict = evict;
+    heap->closure = closure;
+
+    block->offset = start;
+    block->size = size;
+    heap->blocks = block;
+    heapLinkFree(heap, block);
+
+    return heap;
+}
+
+void
+VERMILIONHeapDestroy(VERMILIONHeapPtr heap)
+{
+    VERMILIONHeapBlockPtr block, next;
+
+    for (block = heap->blocks; block; block = next) {
+	next = block->next;
+	free(block);
+    }
+    free(heap);
+}
+
+/*
+ * Blocks are only evicted to make room if evict is set, so that callers
+ * with more than one heap can try them all first.
+ */
+
+VERMILIONHeapBlockPtr
+VERMILIONHeapAlloc(VERMILIONHeapPtr heap, unsigned long size, void *owner,
+    int evict)
+{
+    VERMILIONHeapBlockPtr block, rest;
+
+    size = (size + heap->align - 1) / heap->align * heap->align;
+    if (!size || size > heap->size || !owner) {
+	heap->stats.failures++;
+	return NULL;
+    }
+
+    while (!(block = heapFind(heap, size))) {
+	if (!evict || !heapEvict(heap)) {
+	    heap->stats.failures++;
+	    return NULL;
+	}
+    }
+
+    heapUnlinkFree(heap, block);
+
+    if (block->size > size) {
+	rest = calloc(1, sizeof(*rest));
+	if (rest) {
+	    rest->offset = block->offset + size;
+	    rest->size = block->size - size;
+	    rest->prev = block;
+	    rest->next = block->next;
+	    if (block->next)
+		block->next->prev = rest;
+	    block->next = rest;
+	    block->size = size;
+	    heapLinkFree(heap, rest);
+	}
+    }
+
+    block->owner = owner;
+    block->pinned = 0;
+    heapLinkLRU(heap, block);
+
+    heap->stats.allocs++;
+    heap->stats.usedBlocks++;
+    heap->stats.bytesUsed += block->size;
+    if (heap->stats.bytesUsed > heap->stats.bytesPeak)
+	heap->stats.bytesPeak = heap->stats.bytesUsed;
+
+    return block;
+}
+
+/*
+ * Allocate height lines of widthBytes each, with the pitch rounded up to
+ * pitchAlign rather than to the screen stride.
+ */
+
+VERMILIONHeapBlockPtr
+VERMILIONHeapAllocSurface(VERMILIONHeapPtr heap, unsigned long widthBytes,
+    unsigned long height, unsigned long pitchAlign, unsigned long *pitch,
+    void *owner, int evict)
+{
+    *pitch = (widthBytes + pitchAlign - 1) / pitchAlign * pitchAlign;
+
+    return VERMILIONHeapAlloc(heap, *pitch * height, owner, evict);
+}
+
+void
+VERMILIONHeapFree(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (!block->pinned)
+	heapUnlinkLRU(heap, block);
+    heapRelease(heap, block);
+    heap->stats.frees++;
+}
+
+void
+VERMILIONHeapTouch(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (block->pinned || heap->lruHead == block)
+	return;
+
+    heapUnlinkLRU(heap, block);
+    heapLinkLRU(heap, block);
+}
+
+/*
+ * Pinned blocks are never evicted, for as long as the CPU may be
+ * accessing them.
+ */
+
+void
+VERMILIONHeapPin(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (block->pinned++ == 0)
+	heapUnlinkLRU(heap, block);
+}
+
+void
+VERMILIONHeapUnpin(VERMILIONHeapPtr heap, VERMILIONHeapBlockPtr block)
+{
+    if (--block->pinned == 0)
+	heapLinkLRU(heap, block);
+}
+
+void
+VERMILIONHeapGetStats(VERMILIONHeapPtr heap, VERMILIONHeapStatsPtr stats)
+{
+    VERMILIONHeapBlockPtr block;
+
+    *stats = heap->stats;
+    stats->freeBlocks = 0;
+    stats->largestFree = 0;
+
+    for (block = heap->blocks; block; block = block->next) {
+	if (block->owner)
+	    continue;
+	stats->freeBlocks++;
+	if (block->size > stats->largestFree)
+	    stats->largestFree = block->size;
+    }
+}
@@ -0,0 +1,109 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef _VERMILION_HEAP_H_
+#define _VERMILION_HEAP_H_
+
+/*
+ * Offscreen VRAM heap, see vermilion_heap.c. The heap only hands out
+ * offsets into a range and never touches the memory itself, so it doesn't
+ * depend on the server and can be run against a plain buffer.
+ */
+
+/* Free lists, one per power of two of the size in alignment units */
+#define VERMILION_HEAP_CLASSES 24
+
+typedef struct _VERMILIONHeapBlock
+{
+    unsigned long offset;
+    unsigned long size;
+    void *owner;		       /* NULL while the block is free */
+    int pinned;
+    struct _VERMILIONHeapBlock *prev; /* address order */
+    struct _VERMILIONHeapBlock *next;
+    struct _VERMILIONHeapBlock *linkPrev; /* free list or LRU */
+    struct _VERMILIONHeapBlock *linkNext;
+} VERMILIONHeapBlockRec, *VERMILIONHeapBlockPtr;
+
+typedef struct _VERMILIONHeapStats
+{
+    unsigned long allocs;
+    unsigned long frees;	       /* evictions included */
+    unsigned long evictions;
+    unsigned long failures;
+    unsigned long bytesUsed;
+    unsigned long bytesPeak;
+    unsigned long usedBlocks;
+    unsigned long freeBlocks;
+    unsigned long largestFree;
+} VERMILIONHeapStatsRec, *VERMILIONHeapStatsPtr;
+
+/*
+ * Asked to give up an unpinned block when the heap is full. The owner
+ * copies the contents somewhere else and returns nonzero, after which the
+ * heap frees the block; it must not free it itself.
+ */
+typedef int (*VERMILIONHeapEvictProc) (void *closure, void *owner);
+
+typedef struct _VERMILIONHeap
+{
+    unsigned long offset;
+    unsigned long size;
+    unsigned long align;
+    VERMILIONHeapBlockPtr blocks;
+    VERMILIONHeapBlockPtr freeLists[VERMILION_HEAP_CLASSES];
+    VERMILIONHeapBlockPtr lruHead;    /* most recently used */
+    VERMILIONHeapBlockPtr lruTail;
+    VERMILIONHeapEvictProc evict;
+    void *closure;
+    VERMILIONHeapStatsRec stats;
+} VERMILIONHeapRec, *VERMILIONHeapPtr;
+
+extern VERMILIONHeapPtr VERMILIONHeapCreate(unsigned long offset,
+    unsigned long size, unsigned long align, VERMILIONHeapEvictProc evict,
+    void *closure);
+extern void VERMILIONHeapDestroy(VERMILIONHeapPtr heap);
+extern VERMILIONHeapBlockPtr VERMILIONHeapAlloc(VERMILIONHeapPtr heap,
+    unsigned long size, void *owner, int evict);
+extern VERMILIONHeapBlockPtr VERMILIONHeapAllocSurface(VERMILIONHeapPtr heap,
+    unsigned long widthBytes, unsigned long height, unsigned long pitchAlign,
+    unsigned long *pitch, void *owner, int evict);
+extern void VERMILIONHeapFree(VERMILIONHeapPtr heap,
+    VERMILIONHeapBlockPtr block);
+extern void VERMILIONHeapTouch(VERMILIONHeapPtr heap,
+    VERMILIONHeapBlockPtr block);
+extern void VERMILIONHeapPin(VERMILIONHeapPtr heap,
+    VERMILIONHeapBlockPtr block);
+extern void VERMILIONHeapUnpin(VERMILIONHeapPtr heap,
+    VERMILIONHeapBlockPtr block);
+extern void VERMILIONHeapGetStats(VERMILIONHeapPtr heap,
+    VERMILIONHeapStatsPtr stats);
+
+#endif /* _VERMILION_HEAP_H_ */
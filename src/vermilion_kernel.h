@@ -74,8 +74,24 @@ typedef union {
 	vml_init_rep_t rep;
 } vml_init_t;
 
+/*
+ * VRAM beyond vram_contig_size comes in chunks that aren't contiguous
+ * with the first one. VML_VRAM_CHUNK describes chunk index, counting
+ * from 1, and fails with EINVAL past the last one. Each chunk is mapped
+ * by passing mmap_offset to mmap() on the device. Kernels without it fail
+ * with ENOTTY.
+ */
+typedef struct {
+	unsigned index;
+	unsigned pad;
+	__u64 phys_offset;
+	__u64 size;
+	__u64 mmap_offset;
+} vml_vram_chunk_t;
+
 #define VML_IOC_MAGIC 0xD0
 #define VML_INIT_DEVICE _IOWR(VML_IOC_MAGIC, 0, vml_init_t)
-#define VML_IOC_MAXNR 0
+#define VML_VRAM_CHUNK _IOWR(VML_IOC_MAGIC, 1, vml_vram_chunk_t)
+#define VML_IOC_MAXNR 1
 
 #endif
@@ -0,0 +1,508 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#ifdef VERMILION_TEST
+#include "vermilion_test.h"
+#include "vermilion_kernels.h"
+#else
+#include "vermilion.h"
+#endif
+
+#if defined(USE_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+
+/*
+ * The inner loops of the shadow upload, the depth 15 span writers used
+ * by the XAA hooks, and the depth 15 wfb accessors.
+ * Nothing here depends on the server beyond fb.h's types, so tests/ builds
+ * this file against stubs of those, see tests/vermilion_test.h.
+ */
+
+/*
+ * Plain C scanline copies. These are always available and are used for
+ * the unaligned head and tail of a scanline by the SIMD versions.
+ */
+
+static void
+VERMILIONCopyRow15C(FbBits * dst, const FbBits * src, int n)
+{
+    while (n--)
+	*dst++ = VERMILION_ALPHA15 | *src++;
+}
+
+static void
+VERMILIONCopyRow24C(FbBits * dst, const FbBits * src, int n)
+{
+    while (n--)
+	*dst++ = *src++;
+}
+
+#ifdef USE_SSE2
+
+/*
+ * Align the framebuffer side, which the streaming stores require, and load
+ * the shadow side unaligned.
+ */
+
+#define SSE2_COPY_ROW(_name, _alpha, _store)				\
+static __attribute__((target("sse2"))) void				\
+_name(FbBits * dst, const FbBits * src, int n)				\
+{									\
+    const __m128i alpha = _mm_set1_epi32(_alpha);			\
+    __m128i a, b, c, d;							\
+									\
+    while (n && ((unsigned long)dst & 15)) {				\
+	*dst++ = (_alpha) | *src++;					\
+	n--;								\
+    }									\
+    for (; n >= 16; n -= 16, src += 16, dst += 16) {			\
+	a = _mm_loadu_si128((const __m128i *)src);			\
+	b = _mm_loadu_si128((const __m128i *)src + 1);			\
+	c = _mm_loadu_si128((const __m128i *)src + 2);			\
+	d = _mm_loadu_si128((const __m128i *)src + 3);			\
+	_store((__m128i *)dst, _mm_or_si128(a, alpha));			\
+	_store((__m128i *)dst + 1, _mm_or_si128(b, alpha));		\
+	_store((__m128i *)dst + 2, _mm_or_si128(c, alpha));		\
+	_store((__m128i *)dst + 3, _mm_or_si128(d, alpha));		\
+    }									\
+    for (; n >= 4; n -= 4, src += 4, dst += 4) {			\
+	a = _mm_loadu_si128((const __m128i *)src);			\
+	_store((__m128i *)dst, _mm_or_si128(a, alpha));			\
+    }									\
+    while (n--)								\
+	*dst++ = (_alpha) | *src++;					\
+}
+
+SSE2_COPY_ROW(VERMILIONCopyRow15SSE2, VERMILION_ALPHA15, _mm_store_si128)
+SSE2_COPY_ROW(VERMILIONCopyRow24SSE2, 0, _mm_store_si128)
+SSE2_COPY_ROW(VERMILIONStreamRow15SSE2, VERMILION_ALPHA15, _mm_stream_si128)
+SSE2_COPY_ROW(VERMILIONStreamRow24SSE2, 0, _mm_stream_si128)
+
+static __attribute__((target("sse2"))) void
+VERMILIONFenceSSE2(void)
+{
+    _mm_sfence();
+}
+
+static Bool
+VERMILIONHaveSSE2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+#endif
+
+#ifdef USE_AVX2
+
+#define AVX2_COPY_ROW(_name, _alpha, _store)				\
+static __attribute__((target("avx2"))) void				\
+_name(FbBits * dst, const FbBits * src, int n)				\
+{									\
+    const __m256i alpha = _mm256_set1_epi32(_alpha);			\
+    __m256i a, b;							\
+									\
+    while (n && ((unsigned long)dst & 31)) {				\
+	*dst++ = (_alpha) | *src++;					\
+	n--;								\
+    }									\
+    for (; n >= 16; n -= 16, src += 16, dst += 16) {			\
+	a = _mm256_loadu_si256((const __m256i *)src);			\
+	b = _mm256_loadu_si256((const __m256i *)src + 1);		\
+	_store((__m256i *)dst, _mm256_or_si256(a, alpha));		\
+	_store((__m256i *)dst + 1, _mm256_or_si256(b, alpha));		\
+    }									\
+    for (; n >= 8; n -= 8, src += 8, dst += 8) {			\
+	a = _mm256_loadu_si256((const __m256i *)src);			\
+	_store((__m256i *)dst, _mm256_or_si256(a, alpha));		\
+    }									\
+    while (n--)								\
+	*dst++ = (_alpha) | *src++;					\
+}
+
+AVX2_COPY_ROW(VERMILIONCopyRow15AVX2, VERMILION_ALPHA15, _mm256_store_si256)
+AVX2_COPY_ROW(VERMILIONCopyRow24AVX2, 0, _mm256_store_si256)
+AVX2_COPY_ROW(VERMILIONStreamRow15AVX2, VERMILION_ALPHA15,
+    _mm256_stream_si256)
+AVX2_COPY_ROW(VERMILIONStreamRow24AVX2, 0, _mm256_stream_si256)
+
+static __attribute__((target("avx2"))) void
+VERMILIONFenceAVX2(void)
+{
+    _mm_sfence();
+}
+
+static Bool
+VERMILIONHaveAVX2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef USE_NEON
+
+#define NEON_COPY_ROW(_name, _alpha)					\
+static void								\
+_name(FbBits * dst, const FbBits * src, int n)				\
+{									\
+    const uint32x4_t alpha = vdupq_n_u32(_alpha);			\
+									\
+    while (n && ((unsigned long)dst & 15)) {				\
+	*dst++ = (_alpha) | *src++;					\
+	n--;								\
+    }									\
+    for (; n >= 4; n -= 4, src += 4, dst += 4)				\
+	vst1q_u32((uint32_t *)dst,					\
+	    vorrq_u32(vld1q_u32((const uint32_t *)src), alpha));	\
+    while (n--)								\
+	*dst++ = (_alpha) | *src++;					\
+}
+
+NEON_COPY_ROW(VERMILIONCopyRow15NEON, VERMILION_ALPHA15)
+NEON_COPY_ROW(VERMILIONCopyRow24NEON, 0)
+
+static Bool
+VERMILIONHaveNEON(void)
+{
+    return TRUE;
+}
+#endif
+
+/*
+ * Best first.
+ */
+const VERMILIONShadowKernel VERMILIONShadowKernels[] = {
+#ifdef USE_AVX2
+    {"AVX2", VERMILIONHaveAVX2, VERMILIONCopyRow15AVX2,
+	VERMILIONCopyRow24AVX2, VERMILIONStreamRow15AVX2,
+	VERMILIONStreamRow24AVX2, VERMILIONFenceAVX2},
+#endif
+#ifdef USE_SSE2
+    {"SSE2", VERMILIONHaveSSE2, VERMILIONCopyRow15SSE2,
+	VERMILIONCopyRow24SSE2, VERMILIONStreamRow15SSE2,
+	VERMILIONStreamRow24SSE2, VERMILIONFenceSSE2},
+#endif
+#ifdef USE_NEON
+    {"NEON", VERMILIONHaveNEON, VERMILIONCopyRow15NEON,
+	VERMILIONCopyRow24NEON, NULL, NULL, NULL},
+#endif
+    {"C", NULL, VERMILIONCopyRow15C, VERMILIONCopyRow24C, NULL, NULL, NULL}
+};
+
+const int VERMILIONNumShadowKernels =
+    sizeof(VERMILIONShadowKernels) / sizeof(VERMILIONShadowKernels[0]);
+
+/*
+ * Copy the rows of boxes that fall within [yMin, yMax) from the shadow to
+ * scrBase, normally the linear framebuffer mapping. The caller checks
+ * vtSema. Returns the number of FbBits written.
+ */
+
+unsigned long
+VERMILIONShadowCopyBits(FbBits * scrBase, FbStride scrStride,
+    FbBits * shaBase, FbStride shaStride, int shaBpp, BoxPtr pbox, int nbox,
+    int yMin, int yMax, VERMILIONCopyRowProc copyRow)
+{
+    FbBits *shaLine, *scrLine;
+    int x, y, w, h;
+    unsigned long written = 0;
+
+    for (; nbox--; pbox++) {
+	x = pbox->x1 * shaBpp;
+	y = max(pbox->y1, yMin);
+	w = (pbox->x2 - pbox->x1) * shaBpp;
+	h = min(pbox->y2, yMax) - y;
+	if (h <= 0)
+	    continue;
+
+	shaLine = shaBase + y * shaStride + (x >> FB_SHIFT);
+	scrLine = scrBase + y * scrStride + (x >> FB_SHIFT);
+
+	x &= FB_MASK;
+	w = (w + x + FB_MASK) >> FB_SHIFT;
+	written += (unsigned long)w * h;
+
+	while (h--) {
+	    (*copyRow) (scrLine, shaLine, w);
+	    shaLine += shaStride;
+	    scrLine += scrStride;
+	}
+    }
+
+    return written;
+}
+
+/*
+ * Fence the half we've been packing into and switch to the other one
+ * once the MBX is done reading it.
+ */
+
+void
+VERMILIONShadowStageSubmit(VERMILIONShadowStagePtr stage)
+{
+    int cur = stage->cur;
+
+    if (!stage->used)
+	return;
+
+    stage->seq[cur] = (*stage->emitSeq) (stage->closure);
+
+    stage->cur = cur ^ 1;
+    stage->used = 0;
+    (*stage->waitSeq) (stage->closure, stage->seq[stage->cur]);
+}
+
+/*
+ * ShadowMBX counterpart of VERMILIONShadowCopyBits(): pack each box's
+ * scanlines back to back into staging memory and queue a copy to put them
+ * in place, clipped to width pixels. Boxes too tall for what's left of the
+ * current half are split. fence, or a full barrier if NULL, is run before
+ * each copy is queued. Returns the number of FbBits packed.
+ */
+
+unsigned long
+VERMILIONShadowStageBits(VERMILIONShadowStagePtr stage, FbBits * shaBase,
+    FbStride shaStride, int shaBpp, int width, BoxPtr pbox, int nbox,
+    VERMILIONCopyRowProc copyRow, void (*fence) (void))
+{
+    FbBits *shaLine, *stageLine;
+    int x, y, w, h, pitch, rows, r;
+    int px1, px2;
+    unsigned long written = 0;
+
+    for (; nbox--; pbox++) {
+	x = (pbox->x1 * shaBpp) >> FB_SHIFT;
+	w = ((pbox->x2 * shaBpp + FB_MASK) >> FB_SHIFT) - x;
+	y = pbox->y1;
+	h = pbox->y2 - pbox->y1;
+	if (w <= 0 || h <= 0)
+	    continue;
+
+	px1 = (x << FB_SHIFT) / shaBpp;
+	px2 = min(((x + w) << FB_SHIFT) / shaBpp, width);
+	pitch = (w * (int)sizeof(FbBits) + VERMILION_STAGE_ALIGN - 1) &
+	    ~(VERMILION_STAGE_ALIGN - 1);
+	shaLine = shaBase + y * shaStride + x;
+	written += (unsigned long)w * h;
+
+	while (h > 0) {
+	    rows = min(h, (int)((stage->size - stage->used) / pitch));
+	    if (rows == 0) {
+		VERMILIONShadowStageSubmit(stage);
+		continue;
+	    }
+
+	    stageLine = (FbBits *) (stage->map[stage->cur] + stage->used);
+	    for (r = 0; r < rows; r++) {
+		(*copyRow) (stageLine, shaLine, w);
+		stageLine += pitch / sizeof(FbBits);
+		shaLine += shaStride;
+	    }
+
+	    /* The packed pixels must have left the write-combining buffers
+	     * before the MBX goes to read them. */
+	    if (fence)
+		fence();
+	    else
+		__sync_synchronize();
+
+	    (*stage->upload) (stage->closure,
+		stage->devAddr[stage->cur] + stage->used, pitch,
+		px1, y, px2 - px1, rows);
+
+	    stage->used += (unsigned long)rows * pitch;
+	    y += rows;
+	    h -= rows;
+	}
+    }
+
+    VERMILIONShadowStageSubmit(stage);
+
+    return written;
+}
+
+#if X_BYTE_ORDER == X_BIG_ENDIAN
+#error VERMILIONReadMemory and VERMILIONWriteMemory only work on little endian
+#endif
+
+/*
+ * wfb calls these for every access to the framebuffer at depth 15, almost
+ * always with size 4, so handle the fixed sizes with plain loads and
+ * stores and only go through memcpy for the odd 3 byte case.
+ */
+
+FbBits
+VERMILIONReadMemory(const void *src, int size)
+{
+    FbBits bits = 0;
+
+    switch (size) {
+    case 4:
+	return *(const CARD32 *)src;
+    case 2:
+	return *(const CARD16 *)src;
+    case 1:
+	return *(const CARD8 *)src;
+    default:
+	memcpy(&bits, src, size);
+	return bits;
+    }
+}
+
+void
+VERMILIONWriteMemoryPassthru(void *dst, FbBits value, int size)
+{
+    switch (size) {
+    case 4:
+	*(CARD32 *)dst = value;
+	break;
+    case 2:
+	*(CARD16 *)dst = value;
+	break;
+    case 1:
+	*(CARD8 *)dst = value;
+	break;
+    default:
+	memcpy(dst, &value, size);
+    }
+}
+
+void
+VERMILIONWriteMemorySetAlpha(void *dst, FbBits value, int size)
+{
+    switch (size) {
+    case 4:
+	*(CARD32 *)dst = value | 0x80008000;
+	break;
+    case 3:
+	value |= 0x8000;
+	memcpy(dst, &value, size);
+	break;
+    case 2:
+	*(CARD16 *)dst = value | 0x8000;
+	break;
+    case 1:
+	*(CARD8 *)dst = value;
+	break;
+    default:
+	FatalError("Unsupported size %d in %s", size, __func__);
+    }
+}
+
+/*
+ * Depth 15 spans. fb would write these one word at a time through
+ * VERMILIONWriteMemorySetAlpha(); the XAA hooks write whole spans here
+ * instead and set the alpha bit inline.
+ */
+
+void
+VERMILIONFillSpan15(CARD16 * dst, int w, CARD32 pixel)
+{
+    CARD32 pair, *d;
+
+    pixel |= 0x8000;
+    if (w > 0 && ((unsigned long)dst & 2)) {
+	*dst++ = pixel;
+	w--;
+    }
+
+    pair = (pixel & 0xffff) | pixel << 16;
+    for (d = (CARD32 *) dst; w >= 2; w -= 2)
+	*d++ = pair;
+
+    if (w)
+	*(CARD16 *) d = pixel;
+}
+
+void
+VERMILIONWriteSpan15(CARD16 * dst, const CARD16 * src, int w)
+{
+    int i;
+
+    for (i = 0; i < w; i++)
+	dst[i] = src[i] | 0x8000;
+}
+
+/*
+ * Expand w bits of an LSB first bitmap, starting skip bits into it, to fg
+ * where set and, unless bg is -1, bg where clear.
+ */
+
+void
+VERMILIONExpandSpan15(CARD16 * dst, const CARD8 * bits, int skip, int w,
+    int fg, int bg)
+{
+    CARD8 byte;
+    int i, n;
+
+    bits += skip >> 3;
+    skip &= 7;
+    byte = *bits++ >> skip;
+    n = 8 - skip;		       /* bits left in byte */
+
+    fg |= 0x8000;
+    if (bg == -1) {
+	for (i = 0; i < w; i++, byte >>= 1) {
+	    if (!n--) {
+		byte = *bits++;
+		n = 7;
+		/* Skip runs of clear pixels a byte at a time */
+		while (!byte && i + 8 < w) {
+		    i += 8;
+		    byte = *bits++;
+		}
+	    }
+	    if (byte & 1)
+		dst[i] = fg;
+	}
+    } else {
+	bg |= 0x8000;
+	for (i = 0; i < w; i++, byte >>= 1) {
+	    if (!n--) {
+		byte = *bits++;
+		n = 7;
+	    }
+	    dst[i] = (byte & 1) ? fg : bg;
+	}
+    }
+}
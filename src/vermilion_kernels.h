@@ -0,0 +1,116 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef _VERMILION_KERNELS_H_
+#define _VERMILION_KERNELS_H_
+
+/*
+ * Shadow upload scanline copies and staging, depth 15 spans and wfb
+ * accessors, see vermilion_kernels.c. Needs fb.h, or the stubs in tests/,
+ * included first.
+ */
+
+/* Here we set the high bit on upload for depth 15 because
+ * the hardware requires it. - AlanH.
+ */
+#define VERMILION_ALPHA15 0x80008000
+
+/*
+ * Copies n FbBits of one shadow scanline to the framebuffer.
+ */
+typedef void (*VERMILIONCopyRowProc) (FbBits * dst, const FbBits * src,
+    int n);
+
+typedef struct _VERMILIONShadowKernel
+{
+    const char *name;
+    Bool (*supported) (void);	       /* NULL if always available */
+    VERMILIONCopyRowProc copy15;
+    VERMILIONCopyRowProc copy24;
+    VERMILIONCopyRowProc stream15;     /* NULL if no streaming stores */
+    VERMILIONCopyRowProc stream24;
+    void (*fence) (void);
+} VERMILIONShadowKernel;
+
+/*
+ * Best first, ending with the plain C one.
+ */
+extern const VERMILIONShadowKernel VERMILIONShadowKernels[];
+extern const int VERMILIONNumShadowKernels;
+
+extern unsigned long VERMILIONShadowCopyBits(FbBits * scrBase,
+    FbStride scrStride, FbBits * shaBase, FbStride shaStride, int shaBpp,
+    BoxPtr pbox, int nbox, int yMin, int yMax, VERMILIONCopyRowProc copyRow);
+
+/*
+ * ShadowMBX staging, see VERMILIONShadowStageBits(). Damage is packed into
+ * one half of a staging area in offscreen VRAM while the MBX copies the
+ * other half into place. Each half remembers the MBX sequence number of
+ * the last copy out of it, and we wait for that before packing into the
+ * half again. How the copies reach the MBX is up to the hooks.
+ */
+
+/* Alignment of the packed scanlines in the staging halves */
+#define VERMILION_STAGE_ALIGN 32
+
+typedef struct _VERMILIONShadowStage
+{
+    char *map[2];
+    CARD32 devAddr[2];
+    CARD32 seq[2];
+    unsigned long size;
+    unsigned long used;
+    int cur;
+
+    /* Queue a copy of h packed rows of w pixels at srcAddr to (x, y) */
+    void (*upload) (void *closure, CARD32 srcAddr, int pitch, int x, int y,
+	int w, int h);
+    /* Fence what's queued and return its sequence number */
+    CARD32 (*emitSeq) (void *closure);
+    void (*waitSeq) (void *closure, CARD32 seq);
+    void *closure;
+} VERMILIONShadowStageRec, *VERMILIONShadowStagePtr;
+
+extern void VERMILIONShadowStageSubmit(VERMILIONShadowStagePtr stage);
+extern unsigned long VERMILIONShadowStageBits(VERMILIONShadowStagePtr stage,
+    FbBits * shaBase, FbStride shaStride, int shaBpp, int width,
+    BoxPtr pbox, int nbox, VERMILIONCopyRowProc copyRow,
+    void (*fence) (void));
+
+extern FbBits VERMILIONReadMemory(const void *src, int size);
+extern void VERMILIONWriteMemoryPassthru(void *dst, FbBits value, int size);
+extern void VERMILIONWriteMemorySetAlpha(void *dst, FbBits value, int size);
+
+extern void VERMILIONFillSpan15(CARD16 * dst, int w, CARD32 pixel);
+extern void VERMILIONWriteSpan15(CARD16 * dst, const CARD16 * src, int w);
+extern void VERMILIONExpandSpan15(CARD16 * dst, const CARD8 * bits, int skip,
+    int w, int fg, int bg);
+
+#endif /* _VERMILION_KERNELS_H_ */
@@ -45,6 +45,26 @@
 #define MBX1_INT_TA_FREEVCOUNT_MASK             0x00FF0000
 #define MBX1_INT_TA_FREEVCOUNT_SHIFT    16
 
+/*
+	Ring of fence slots at the very end of VRAM that the MBX writes
+	sequence numbers to, see VERMILIONMBXEmitSeq(), followed by the
+	background/foreground source palettes used for colour expansion and
+	the expanded mono 8x8 patterns. The patterns come last so that they
+	stay aligned to MBX_PAT_SLOT_SIZE.
+*/
+#define MBX_FENCE_SLOTS		16
+#define MBX_PAL_MAP_SIZE	(VERMILION_PAL_SLOTS * 8)
+#define MBX_PAT_PITCH		32
+#define MBX_PAT_SLOT_SIZE	(8 * MBX_PAT_PITCH)
+#define MBX_PAT_MAP_SIZE	(VERMILION_PAT_SLOTS * MBX_PAT_SLOT_SIZE)
+#define MBX_SYNC_MAP_SIZE	(MBX_FENCE_SLOTS * 4 + MBX_PAL_MAP_SIZE + \
+				 MBX_PAT_MAP_SIZE)
+
+/*
+	Is sequence number a at or after b, allowing for wraparound?
+*/
+#define MBX_SEQ_PASSED(a, b)	((INT32) ((a) - (b)) >= 0)
+
 /*
 	MBX Slave Port's offset into the register aperture
 */
@@ -62,13 +82,29 @@
 #define MBX_EXTRACT_FIFO_COUNT(x)   (((x) & MBX1_INT_TA_FREEVCOUNT_MASK) >> MBX1_INT_TA_FREEVCOUNT_SHIFT)
 
 static __inline__ void
+MBXReadFifoSpace(VERMILIONPtr pVermilion)
+{
+    /* read fifo space from HW */
+    pVermilion->FifoSlots = (MBX1_SP_FIFO_DWSIZE -
+	MBX_EXTRACT_FIFO_COUNT(ReadHWReg(MBX1_GLOBREG_INT_STATUS)));
+    pVermilion->cmdStatusReads++;
+}
+
+/*
+ * Returns FALSE if the FIFO didn't drain in time, see
+ * VERMILIONMBXWaitFifo().
+ */
+static __inline__ Bool
 MBXAcquireFifoSpace(VERMILIONPtr pVermilion, CARD32 n)
 {
-    while (pVermilion->FifoSlots < n) {
-	/* read fifo space from HW */
-	pVermilion->FifoSlots = (MBX1_SP_FIFO_DWSIZE -
-	    MBX_EXTRACT_FIFO_COUNT(ReadHWReg(MBX1_GLOBREG_INT_STATUS)));
-    }
+    if (pVermilion->FifoSlots >= n)
+	return TRUE;
+
+    MBXReadFifoSpace(pVermilion);
+    if (pVermilion->FifoSlots >= n)
+	return TRUE;
+
+    return VERMILIONMBXWaitFifo(pVermilion, n);
 }
 
 static __inline__ void
@@ -84,25 +120,117 @@ MBXWriteSlavePortBatch(VERMILIONPtr pVermilion, void *pvLinDataAddr,
     }
 }
 
+/*
+ * Packets are collected in pVermilion->cmdBuf and only written to the
+ * slave port by MBXFlushCommands(), in bursts as large as the free FIFO
+ * space allows. That happens when the buffer fills up, on sync and fences,
+ * and from the BlockHandler. With Option "AccelThread" the submission
+ * thread in vermilion_submit.c does the writing instead.
+ */
+static __inline__ void
+MBXFlushCommands(VERMILIONPtr pVermilion)
+{
+    CARD32 *cmd = pVermilion->cmdBuf;
+    CARD32 left = pVermilion->cmdCount;
+    CARD32 n;
+
+    if (pVermilion->mbxSubmit) {
+	if (left)
+	    VERMILIONSubmitPush(pVermilion, cmd, left);
+	pVermilion->cmdDwords += left;
+	pVermilion->cmdCount = 0;
+	pVermilion->cmdOwed = pVermilion->hostOwed;
+	return;
+    }
+
+    while (left) {
+	if (!MBXAcquireFifoSpace(pVermilion, 1))
+	    break;
+	n = min(left, pVermilion->FifoSlots);
+	MBXWriteSlavePortBatch(pVermilion, cmd, n);
+	pVermilion->FifoSlots -= n;
+	cmd += n;
+	left -= n;
+	pVermilion->cmdBursts++;
+    }
+
+    pVermilion->cmdDwords += pVermilion->cmdCount;
+    pVermilion->cmdCount = 0;
+    pVermilion->cmdOwed = pVermilion->hostOwed;
+}
+
+static __inline__ void
+MBXReserveCommands(VERMILIONPtr pVermilion, CARD32 n)
+{
+    if (pVermilion->cmdCount + n > VERMILION_CMD_BUF_SIZE)
+	MBXFlushCommands(pVermilion);
+}
+
+static __inline__ void
+MBXQueueCommands(VERMILIONPtr pVermilion, const CARD32 *cmd, CARD32 n)
+{
+    memcpy(pVermilion->cmdBuf + pVermilion->cmdCount, cmd,
+	n * sizeof(CARD32));
+    pVermilion->cmdCount += n;
+    pVermilion->mbxDirty = TRUE;
+}
+
+/*
+ * Queue n dwords of host data for a blit, ORing alpha into each, in
+ * pieces small enough for the command buffer. hostOwed counts down what
+ * the blit still needs, so that vermilion_submit.c can tell which
+ * flushes end in the middle of one.
+ */
+static __inline__ void
+MBXQueueHostData(VERMILIONPtr pVermilion, const CARD32 *src, CARD32 n,
+    CARD32 alpha)
+{
+    CARD32 *dst;
+    CARD32 i, chunk;
+
+    while (n) {
+	chunk = min(n, VERMILION_CMD_BUF_SIZE / 2);
+	MBXReserveCommands(pVermilion, chunk);
+	dst = pVermilion->cmdBuf + pVermilion->cmdCount;
+	for (i = 0; i < chunk; i++)
+	    dst[i] = src[i] | alpha;
+	pVermilion->cmdCount += chunk;
+	pVermilion->hostOwed -= min(chunk, pVermilion->hostOwed);
+	src += chunk;
+	n -= chunk;
+    }
+    pVermilion->mbxDirty = TRUE;
+}
+
 #define WRITESLAVEPORTDATA(n)			\
-	(void) MBXWriteSlavePortBatch ( pVermilion, auBltPacket, n );
+	MBXQueueCommands(pVermilion, auBltPacket, n);
 
 #define WAITFIFO(n) 		\
-	MBXAcquireFifoSpace(pVermilion, n);	\
-	pVermilion->FifoSlots -= n;
+	MBXReserveCommands(pVermilion, n);
 
 /*
  * Block headers
  */
+#define	MBX2D_PAT_BH		0x10000000
 #define	MBX2D_CTRL_BH		0x20000000
 #define	MBX2D_SRC_OFF_BH	0x30000000
 #define	MBX2D_FENCE_BH		0x70000000	/* Flush between two blits */
 #define	MBX2D_BLIT_BH		0x80000000
 #define	MBX2D_SRC_CTRL_BH	0x90000000
 #define MBX2D_DST_CTRL_BH	0xA0000000
+#define MBX2D_PAT_CTRL_BH	0xB0000000	/* Followed by pattern address */
+#define MBX2D_SRC_PAL_BH	0xC0000000	/* Followed by palette address */
 
 #define MBX2D_USE_PAT			0x00010000
 
+/*
+ * Pattern size and the pattern pixel at the top left of the blit
+ */
+#define MBX2D_PAT_WIDTH_SHIFT	0
+#define MBX2D_PAT_HEIGHT_SHIFT	6
+#define MBX2D_PAT_XSTART_SHIFT	12
+#define MBX2D_PAT_YSTART_SHIFT	18
+
 #define MBX2D_TEXTCOPY_TL2BR	0x00000000
 #define MBX2D_TEXTCOPY_TR2BL	0x00800000
 #define MBX2D_TEXTCOPY_BL2TR	0x01000000
@@ -110,8 +238,148 @@ MBXWriteSlavePortBatch(VERMILIONPtr pVermilion, void *pvLinDataAddr,
 #define MBX2D_SRCCK_REJECT		0x00100000
 #define MBX2D_SRCCK_CTRL	0x00000001
 
+/*
+ * Without MBX2D_SRC_FBMEM the source is host data, written to the slave
+ * port after the blit block.
+ */
 #define MBX2D_SRC_FBMEM				0x04000000
+#define MBX2D_SRC_1_PAL				0x00000000
 #define MBX2D_SRC_555RGB			0x00040000
 #define MBX2D_SRC_8888ARGB			0x00060000
 
+/*
+ * The engine's surface and colour key registers keep their values across
+ * blits, so the last values sent are remembered and packets that wouldn't
+ * change them are dropped. mbxStateValid says which of them are known;
+ * it's cleared whenever the engine or the command buffer may have been
+ * reset behind our back.
+ */
+#define MBX_STATE_SRC		0x00000001
+#define MBX_STATE_DST		0x00000002
+#define MBX_STATE_CKEY		0x00000004
+#define MBX_STATE_PAT		0x00000008
+
+/*
+ * Blit coordinates are 12 bits, so a blit that reaches past row
+ * MBX_MAX_COORD of a surface gets a surface based at a row nearer to it.
+ * The base is rounded down to MBX_REBASE_ROWS where that still fits, so
+ * that neighbouring blits share it and the state cache can drop the
+ * surface packets. Returns the base row and makes y relative to it.
+ *
+ * Blits taller than MBX_MAX_COORD aren't split: nothing draws them, since
+ * no drawable is that tall. The screen is at most 2048 rows, and XAA and
+ * EXA pixmaps are capped at MBX_MAX_COORD with maxOffPixHeight and maxY.
+ * One would be a driver bug, and is fatal rather than drawn with its
+ * coordinates wrapped.
+ */
+#define MBX_MAX_COORD		4095
+#define MBX_REBASE_ROWS		1024
+
+static __inline__ int
+MBXRebaseRow(int *y, int h)
+{
+    int base = 0;
+
+    if (h > MBX_MAX_COORD)
+	FatalError("MBX blit of %d rows is too tall\n", h);
+
+    if (*y + h > MBX_MAX_COORD) {
+	base = *y & ~(MBX_REBASE_ROWS - 1);
+	if (*y - base + h > MBX_MAX_COORD)
+	    base = *y;
+	*y -= base;
+    }
+
+    return base;
+}
+
+static __inline__ void
+MBXSetSrcSurface(VERMILIONPtr pVermilion, CARD32 ctrl, CARD32 addr)
+{
+    CARD32 auBltPacket[2];
+
+    if ((pVermilion->mbxStateValid & MBX_STATE_SRC) &&
+	pVermilion->mbxSrcCtrl == ctrl && pVermilion->mbxSrcAddr == addr) {
+	pVermilion->cmdSaved += 2;
+	return;
+    }
+
+    WAITFIFO(2);
+
+    auBltPacket[0] = MBX2D_SRC_CTRL_BH | ctrl;
+    auBltPacket[1] = addr;
+    WRITESLAVEPORTDATA(2);
+
+    pVermilion->mbxSrcCtrl = ctrl;
+    pVermilion->mbxSrcAddr = addr;
+    pVermilion->mbxStateValid |= MBX_STATE_SRC;
+}
+
+static __inline__ void
+MBXSetDstSurface(VERMILIONPtr pVermilion, CARD32 ctrl, CARD32 addr)
+{
+    CARD32 auBltPacket[2];
+
+    if ((pVermilion->mbxStateValid & MBX_STATE_DST) &&
+	pVermilion->mbxDstCtrl == ctrl && pVermilion->mbxDstAddr == addr) {
+	pVermilion->cmdSaved += 2;
+	return;
+    }
+
+    WAITFIFO(2);
+
+    auBltPacket[0] = MBX2D_DST_CTRL_BH | ctrl;
+    auBltPacket[1] = addr;
+    WRITESLAVEPORTDATA(2);
+
+    pVermilion->mbxDstCtrl = ctrl;
+    pVermilion->mbxDstAddr = addr;
+    pVermilion->mbxStateValid |= MBX_STATE_DST;
+}
+
+static __inline__ void
+MBXSetPatSurface(VERMILIONPtr pVermilion, CARD32 ctrl, CARD32 addr)
+{
+    CARD32 auBltPacket[2];
+
+    if ((pVermilion->mbxStateValid & MBX_STATE_PAT) &&
+	pVermilion->mbxPatCtrl == ctrl && pVermilion->mbxPatAddr == addr) {
+	pVermilion->cmdSaved += 2;
+	return;
+    }
+
+    WAITFIFO(2);
+
+    auBltPacket[0] = MBX2D_PAT_CTRL_BH | ctrl;
+    auBltPacket[1] = addr;
+    WRITESLAVEPORTDATA(2);
+
+    pVermilion->mbxPatCtrl = ctrl;
+    pVermilion->mbxPatAddr = addr;
+    pVermilion->mbxStateValid |= MBX_STATE_PAT;
+}
+
+static __inline__ void
+MBXSetColorKey(VERMILIONPtr pVermilion, CARD32 key, CARD32 mask)
+{
+    CARD32 auBltPacket[3];
+
+    if ((pVermilion->mbxStateValid & MBX_STATE_CKEY) &&
+	pVermilion->mbxColorKey == key && pVermilion->mbxColorKeyMask == mask) {
+	pVermilion->cmdSaved += 3;
+	return;
+    }
+
+    WAITFIFO(3);
+
+    auBltPacket[0] = MBX2D_CTRL_BH | MBX2D_SRCCK_CTRL;
+    auBltPacket[1] = key;
+    auBltPacket[2] = mask;
+    WRITESLAVEPORTDATA(3);
+
+    pVermilion->mbxColorKey = key;
+    pVermilion->mbxColorKeyMask = mask;
+    pVermilion->mbxStateValid |= MBX_STATE_CKEY;
+}
+
 #endif /* _VERMILION_MBX_H_ */
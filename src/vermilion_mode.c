@@ -104,6 +104,14 @@ VERMILIONValidMode(int scrnIndex, DisplayModePtr mode, Bool verbose,
     return MODE_OK;
 }
 
+static Bool
+VERMILIONPadReady(ScrnInfoPtr pScrn, void *arg)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    return (VML_READ32(VML_RCOMPSTAT) & *(CARD32 *) arg) != 0;
+}
+
 void
 VERMILIONWaitForVblank(ScrnInfoPtr pScrn)
 {
@@ -136,10 +144,11 @@ void
 VERMILIONDisablePipe(ScrnInfoPtr pScrn)
 {
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    CARD32 mask = VML_MDVO_VDC_I_RCOMP;
 
     /* Disable the MDVO pad */
     VML_WRITE32(VML_RCOMPSTAT, 0);
-    while (!(VML_READ32(VML_RCOMPSTAT) & VML_MDVO_VDC_I_RCOMP)) ;
+    VERMILIONWait(pScrn, VERMILION_WAIT_PAD_OFF, VERMILIONPadReady, &mask);
 
     /* Disable display planes */
     VML_WRITE32(VML_DSPCCNTR, VML_READ32(VML_DSPCCNTR) & ~VML_GFX_ENABLE);
@@ -205,7 +214,7 @@ VERMILIONDoSetMode(ScrnInfoPtr pScrn, DisplayModePtr pMode, Bool plane_enable)
     VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
     VERMILIONSys *sys = pVermilion->sys;
     CARD32 htot, hblank, hsync, vtot, vblank, vsync, dspcntr;
-    CARD32 pipesrc, dspsize;
+    CARD32 pipesrc, dspsize, mask;
     int pixelClock;
     Bool ret = FALSE;
     int index;
@@ -304,8 +313,8 @@ VERMILIONDoSetMode(ScrnInfoPtr pScrn, DisplayModePtr pMode, Bool plane_enable)
     
     /* Enable the MDVO pad */
     VML_WRITE32(VML_RCOMPSTAT, VML_MDVO_PAD_ENABLE);
-    while (!(VML_READ32(VML_RCOMPSTAT) &
-	    (VML_MDVO_VDC_I_RCOMP | VML_MDVO_PAD_ENABLE))) ;
+    mask = VML_MDVO_VDC_I_RCOMP | VML_MDVO_PAD_ENABLE;
+    VERMILIONWait(pScrn, VERMILION_WAIT_PAD_ON, VERMILIONPadReady, &mask);
 
     pVermilion->curMode = *pMode;
     if (pVermilion->debug)
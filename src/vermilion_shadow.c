@@ -0,0 +1,1051 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "vermilion.h"
+#include "vermilion_mbx.h"
+
+/*
+ * Change detection granularity of the ShadowTileHash mode, in pixels.
+ */
+#define VERMILION_TILE_WIDTH 64
+#define VERMILION_TILE_HEIGHT 16
+
+#define VERMILION_TILE_VALID	0x1    /* hash matches the framebuffer */
+#define VERMILION_TILE_DAMAGED	0x2
+
+/*
+ * Flushes smaller than this many pixels aren't worth waking the
+ * ShadowThreads workers for.
+ */
+#define VERMILION_SHADOW_THREAD_MIN (256 * 256)
+
+/*
+ * Longest pending list the ShadowAsync flusher is allowed to fall behind
+ * by before it's collapsed into a single box.
+ */
+#define VERMILION_SHADOW_ASYNC_MAX_BOXES 1024
+
+/*
+ * ShadowMBX staging memory, per half.
+ */
+#define VERMILION_STAGE_SIZE (1024 * 1024)
+
+/*
+ * Worker pool for ShadowThreads. A flush is split into horizontal bands,
+ * one per worker plus one for the calling thread, and the caller waits for
+ * all bands before returning to the shadow layer.
+ */
+
+typedef struct _VERMILIONShadowPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_t *threads;
+    int nThreads;		       /* not counting the caller */
+    int running;		       /* workers started */
+    unsigned long generation;
+    int busy;
+    Bool quit;
+
+    /* Current flush */
+    VERMILIONPtr pVermilion;
+    PixmapPtr pShadow;
+    BoxPtr pbox;
+    int nbox;
+    int y1;
+    int y2;
+    unsigned long written;
+} VERMILIONShadowPoolRec;
+
+/*
+ * ShadowAsync state. The server thread snapshots the damage into the
+ * pending list and carries on; the flusher thread swaps it with the
+ * active list and uploads it. Damage that arrives while a flush is in
+ * flight is merged into the pending list and uploaded by the next flush,
+ * so the framebuffer always ends up matching the shadow.
+ */
+
+typedef struct _VERMILIONShadowAsync
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t thread;
+    Bool quit;
+    Bool busy;
+
+    ScrnInfoPtr pScrn;
+    PixmapPtr pShadow;
+    BoxPtr pending;
+    int nPending;
+    int pendingSize;
+    unsigned long long pendingSince;
+    BoxPtr active;
+    int activeSize;
+    VERMILIONWaitStatsRec waitStats[VERMILION_NUM_WAITS];
+} VERMILIONShadowAsyncRec;
+
+static VERMILIONShadowPoolPtr VERMILIONShadowPoolCreate(int nThreads);
+static void VERMILIONShadowPoolDestroy(VERMILIONShadowPoolPtr pool);
+static VERMILIONShadowAsyncPtr VERMILIONShadowAsyncCreate(ScrnInfoPtr pScrn);
+static void VERMILIONShadowAsyncDestroy(VERMILIONShadowAsyncPtr async);
+static VERMILIONShadowStagePtr VERMILIONShadowStageCreate(ScrnInfoPtr pScrn);
+
+static unsigned long long
+VERMILIONShadowUsecs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Pick the fastest scanline copy the CPU we're running on supports.
+ */
+
+void
+VERMILIONShadowInit(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    const VERMILIONShadowKernel *kernel;
+    int i;
+
+    for (i = 0; i < VERMILIONNumShadowKernels; i++) {
+	kernel = &VERMILIONShadowKernels[i];
+	if (!kernel->supported || kernel->supported())
+	    break;
+    }
+
+    pVermilion->shadowCopyRow = (pScrn->depth == 15) ?
+	kernel->copy15 : kernel->copy24;
+    pVermilion->shadowFence = NULL;
+
+    if (pVermilion->shadowStreaming) {
+	if (kernel->fence) {
+	    pVermilion->shadowCopyRow = (pScrn->depth == 15) ?
+		kernel->stream15 : kernel->stream24;
+	    pVermilion->shadowFence = kernel->fence;
+	} else {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Streaming stores not supported by the %s shadow upload.\n",
+		kernel->name);
+	    pVermilion->shadowStreaming = FALSE;
+	}
+    }
+
+    memset(&pVermilion->shadowStats, 0, sizeof(pVermilion->shadowStats));
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"Using %s%s shadow framebuffer upload.\n", kernel->name,
+	pVermilion->shadowStreaming ? " streaming" : "");
+
+    if (pVermilion->shadowTileHash) {
+	int nTiles;
+
+	pVermilion->shadowTilesX = (pScrn->virtualX + VERMILION_TILE_WIDTH - 1)
+	    / VERMILION_TILE_WIDTH;
+	pVermilion->shadowTilesY = (pScrn->virtualY + VERMILION_TILE_HEIGHT - 1)
+	    / VERMILION_TILE_HEIGHT;
+	nTiles = pVermilion->shadowTilesX * pVermilion->shadowTilesY;
+
+	pVermilion->shadowTiles = xcalloc(nTiles, sizeof(VERMILIONTileRec));
+	pVermilion->shadowTileBoxes = xalloc(nTiles * sizeof(BoxRec));
+	if (!pVermilion->shadowTiles || !pVermilion->shadowTileBoxes) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Failed to allocate shadow tile hashes, uploading all "
+		"damage.\n");
+	    xfree(pVermilion->shadowTiles);
+	    xfree(pVermilion->shadowTileBoxes);
+	    pVermilion->shadowTiles = NULL;
+	    pVermilion->shadowTileBoxes = NULL;
+	    pVermilion->shadowTileHash = FALSE;
+	} else {
+	    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		"Skipping unchanged %dx%d shadow tiles.\n",
+		VERMILION_TILE_WIDTH, VERMILION_TILE_HEIGHT);
+	}
+    }
+
+    pVermilion->shadowPool = NULL;
+    if (pVermilion->shadowThreads > 1) {
+	pVermilion->shadowPool =
+	    VERMILIONShadowPoolCreate(pVermilion->shadowThreads - 1);
+	if (!pVermilion->shadowPool) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Failed to start shadow upload threads.\n");
+	} else {
+	    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		"Uploading large shadow updates with %d threads.\n",
+		pVermilion->shadowPool->nThreads + 1);
+	}
+    }
+
+    pVermilion->shadowStage = NULL;
+    if (pVermilion->shadowMBX) {
+	pVermilion->shadowStage = VERMILIONShadowStageCreate(pScrn);
+	if (!pVermilion->shadowStage) {
+	    pVermilion->shadowMBX = FALSE;
+	} else {
+	    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		"Placing shadow updates with the MBX through 2 x %lu kB of "
+		"staging memory.\n", pVermilion->shadowStage->size / 1024);
+	}
+    }
+
+    pVermilion->shadowAsyncRec = NULL;
+    if (pVermilion->shadowAsync) {
+	pVermilion->shadowAsyncRec = VERMILIONShadowAsyncCreate(pScrn);
+	if (!pVermilion->shadowAsyncRec) {
+	    xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		"Failed to start the shadow flusher thread, uploading "
+		"synchronously.\n");
+	    pVermilion->shadowAsync = FALSE;
+	}
+    }
+}
+
+/*
+ * Wait until all damage handed to the flusher thread or the MBX is in the
+ * framebuffer. Must be called before anything else touches the
+ * framebuffer or the tile hashes.
+ */
+
+void
+VERMILIONShadowSync(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowAsyncPtr async = pVermilion->shadowAsyncRec;
+
+    if (async) {
+	pthread_mutex_lock(&async->lock);
+	while (async->busy || async->nPending)
+	    pthread_cond_wait(&async->idle, &async->lock);
+	pthread_mutex_unlock(&async->lock);
+    }
+
+    if (pVermilion->shadowStage && pScrn->vtSema) {
+	VERMILIONMBXWaitSeq(pScrn, pVermilion->shadowStage->seq[0]);
+	VERMILIONMBXWaitSeq(pScrn, pVermilion->shadowStage->seq[1]);
+    }
+}
+
+/*
+ * The framebuffer contents no longer match what the tile hashes say was
+ * uploaded, e.g. because LeaveVT cleared it. Upload every tile again.
+ */
+
+void
+VERMILIONShadowInvalidate(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowStagePtr stage = pVermilion->shadowStage;
+    int i;
+
+    VERMILIONShadowSync(pScrn);
+
+    if (stage)
+	stage->used = 0;
+
+    if (!pVermilion->shadowTiles)
+	return;
+
+    for (i = 0; i < pVermilion->shadowTilesX * pVermilion->shadowTilesY; i++)
+	pVermilion->shadowTiles[i].flags &= ~VERMILION_TILE_VALID;
+}
+
+/*
+ * Print what the shadow upload has done since ScreenInit.
+ */
+
+static void
+VERMILIONShadowReport(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowStatsPtr stats = &pVermilion->shadowStats;
+    double mb = (double)stats->bytes / (1024. * 1024.);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"Shadow upload: %lu flushes, %.1f MB in %.3f s, %.1f MB/s (%s).\n",
+	stats->flushes, mb, (double)stats->usecs / 1000000.,
+	stats->usecs ? mb * 1000000. / (double)stats->usecs : 0.,
+	pVermilion->shadowStreaming ? "streaming" : "cached");
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	"Shadow upload: %llu damage boxes coalesced into %llu.\n",
+	stats->boxesIn, stats->boxesOut);
+    if (pVermilion->shadowTileHash) {
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Shadow upload: %llu of %llu damaged tiles unchanged (%.1f%%).\n",
+	    stats->tilesSkipped, stats->tilesChecked,
+	    stats->tilesChecked ? 100. * (double)stats->tilesSkipped /
+	    (double)stats->tilesChecked : 0.);
+    }
+    if (stats->updates) {
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Shadow upload (%s): server thread stalled %.1f us per update, "
+	    "damage reached the framebuffer after %.1f us on average.\n",
+	    pVermilion->shadowAsync ? "asynchronous" : "synchronous",
+	    (double)stats->stallUsecs / (double)stats->updates,
+	    stats->latencyCount ? (double)stats->latencyUsecs /
+	    (double)stats->latencyCount : 0.);
+    }
+}
+
+void
+VERMILIONShadowFini(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    if (pVermilion->shadowAsyncRec) {
+	VERMILIONShadowAsyncDestroy(pVermilion->shadowAsyncRec);
+	pVermilion->shadowAsyncRec = NULL;
+    }
+
+    if (pVermilion->shadowStage) {
+	VERMILIONShadowSync(pScrn);
+	xfree(pVermilion->shadowStage);
+	pVermilion->shadowStage = NULL;
+    }
+
+    VERMILIONShadowReport(pScrn);
+
+    if (pVermilion->shadowPool) {
+	VERMILIONShadowPoolDestroy(pVermilion->shadowPool);
+	pVermilion->shadowPool = NULL;
+    }
+
+    xfree(pVermilion->shadowBoxes);
+    pVermilion->shadowBoxes = NULL;
+    pVermilion->shadowBoxesSize = 0;
+
+    xfree(pVermilion->shadowTiles);
+    xfree(pVermilion->shadowTileBoxes);
+    pVermilion->shadowTiles = NULL;
+    pVermilion->shadowTileBoxes = NULL;
+}
+
+/*
+ * Merge damage boxes when uploading the gap pixels between them is cheaper
+ * than setting up the extra scanlines. pVermilion->shadowCoalesce is the
+ * setup cost of one scanline of a box, in pixels. Damage regions are
+ * y-x banded, so candidates are the last few boxes already emitted, which
+ * covers neighbours in the same band and in the band above.
+ */
+
+#define VERMILION_COALESCE_LOOKBACK 4
+
+static int
+VERMILIONShadowCoalesce(VERMILIONPtr pVermilion, BoxPtr pbox, int nbox)
+{
+    BoxPtr out = pVermilion->shadowBoxes;
+    long cost = pVermilion->shadowCoalesce;
+    int nout = 0;
+    int i, j;
+    Bool merged;
+
+    for (i = 0; i < nbox; i++, pbox++) {
+	merged = FALSE;
+	for (j = nout - 1; j >= 0 && j >= nout - VERMILION_COALESCE_LOOKBACK;
+	    j--) {
+	    BoxPtr b = &out[j];
+	    BoxRec u;
+	    long extra, saved;
+
+	    u.x1 = min(b->x1, pbox->x1);
+	    u.y1 = min(b->y1, pbox->y1);
+	    u.x2 = max(b->x2, pbox->x2);
+	    u.y2 = max(b->y2, pbox->y2);
+
+	    extra = (long)(u.x2 - u.x1) * (u.y2 - u.y1) -
+		(long)(b->x2 - b->x1) * (b->y2 - b->y1) -
+		(long)(pbox->x2 - pbox->x1) * (pbox->y2 - pbox->y1);
+	    saved = cost * ((b->y2 - b->y1) + (pbox->y2 - pbox->y1) -
+		(u.y2 - u.y1) + 1);
+
+	    if (extra <= saved) {
+		*b = u;
+		merged = TRUE;
+		break;
+	    }
+	}
+	if (!merged)
+	    out[nout++] = *pbox;
+    }
+
+    return nout;
+}
+
+/*
+ * 64-bit FNV-1a over the FbBits of one tile of the shadow.
+ */
+
+static unsigned long long
+VERMILIONShadowHashTile(const FbBits * sha, FbStride shaStride, int w, int h)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    while (h--) {
+	for (i = 0; i < w; i++)
+	    hash = (hash ^ sha[i]) * 0x100000001b3ULL;
+	sha += shaStride;
+    }
+
+    return hash;
+}
+
+/*
+ * Reduce the damage to the tiles whose contents actually changed since
+ * they were last uploaded. Changed tiles are always uploaded whole, since
+ * the hash covers the whole tile. Returns the number of boxes in
+ * pVermilion->shadowTileBoxes.
+ */
+
+static int
+VERMILIONShadowFilterTiles(ScrnInfoPtr pScrn, PixmapPtr pShadow,
+    BoxPtr pbox, int nbox)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowStatsPtr stats = &pVermilion->shadowStats;
+    VERMILIONTilePtr tiles = pVermilion->shadowTiles;
+    int tilesX = pVermilion->shadowTilesX;
+    BoxPtr out = pVermilion->shadowTileBoxes;
+    FbBits *shaBase;
+    FbStride shaStride;
+    int shaBpp;
+    int shaXoff, shaYoff;	       /* XXX assumed to be zero */
+    int tx, ty, tx1, ty1, tx2, ty2;
+    int yMin = pVermilion->shadowTilesY, yMax = 0;
+    int nout = 0;
+
+    fbGetDrawable(&pShadow->drawable, shaBase, shaStride, shaBpp, shaXoff,
+	shaYoff);
+
+    while (nbox--) {
+	tx1 = pbox->x1 / VERMILION_TILE_WIDTH;
+	ty1 = pbox->y1 / VERMILION_TILE_HEIGHT;
+	tx2 = (pbox->x2 + VERMILION_TILE_WIDTH - 1) / VERMILION_TILE_WIDTH;
+	ty2 = (pbox->y2 + VERMILION_TILE_HEIGHT - 1) / VERMILION_TILE_HEIGHT;
+	for (ty = ty1; ty < ty2; ty++)
+	    for (tx = tx1; tx < tx2; tx++)
+		tiles[ty * tilesX + tx].flags |= VERMILION_TILE_DAMAGED;
+	yMin = min(yMin, ty1);
+	yMax = max(yMax, ty2);
+	pbox++;
+    }
+
+    for (ty = yMin; ty < yMax; ty++) {
+	BoxPtr run = NULL;
+
+	for (tx = 0; tx < tilesX; tx++) {
+	    VERMILIONTilePtr tile = &tiles[ty * tilesX + tx];
+	    unsigned long long hash;
+	    BoxRec b;
+
+	    if (!(tile->flags & VERMILION_TILE_DAMAGED)) {
+		run = NULL;
+		continue;
+	    }
+
+	    b.x1 = tx * VERMILION_TILE_WIDTH;
+	    b.y1 = ty * VERMILION_TILE_HEIGHT;
+	    b.x2 = min(b.x1 + VERMILION_TILE_WIDTH, pScrn->virtualX);
+	    b.y2 = min(b.y1 + VERMILION_TILE_HEIGHT, pScrn->virtualY);
+
+	    hash = VERMILIONShadowHashTile(shaBase + b.y1 * shaStride +
+		((b.x1 * shaBpp) >> FB_SHIFT), shaStride,
+		((b.x2 - b.x1) * shaBpp + FB_MASK) >> FB_SHIFT, b.y2 - b.y1);
+
+	    stats->tilesChecked++;
+	    if ((tile->flags & VERMILION_TILE_VALID) && tile->hash == hash) {
+		stats->tilesSkipped++;
+		tile->flags &= ~VERMILION_TILE_DAMAGED;
+		run = NULL;
+		continue;
+	    }
+	    tile->hash = hash;
+	    tile->flags = VERMILION_TILE_VALID;
+
+	    /* Extend the previous changed tile in this row if adjacent. */
+	    if (run) {
+		run->x2 = b.x2;
+	    } else {
+		run = &out[nout++];
+		*run = b;
+	    }
+	}
+    }
+
+    return nout;
+}
+
+static unsigned long
+VERMILIONShadowCopy(VERMILIONPtr pVermilion, PixmapPtr pShadow, BoxPtr pbox,
+    int nbox, int yMin, int yMax, VERMILIONCopyRowProc copyRow)
+{
+    FbBits *shaBase;
+    FbStride shaStride;
+    int shaBpp;
+    int shaXoff, shaYoff;	       /* XXX assumed to be zero */
+
+    fbGetDrawable(&pShadow->drawable, shaBase, shaStride, shaBpp, shaXoff,
+	shaYoff);
+
+    return VERMILIONShadowCopyBits((FbBits *) pVermilion->fbMap,
+	pVermilion->stride / sizeof(FbBits), shaBase, shaStride, shaBpp,
+	pbox, nbox, yMin, yMax, copyRow);
+}
+
+static void
+VERMILIONShadowBand(VERMILIONShadowPoolPtr pool, int band, int *yMin,
+    int *yMax)
+{
+    int h = pool->y2 - pool->y1;
+
+    *yMin = pool->y1 + h * band / (pool->nThreads + 1);
+    *yMax = pool->y1 + h * (band + 1) / (pool->nThreads + 1);
+}
+
+static void *
+VERMILIONShadowWorker(void *arg)
+{
+    VERMILIONShadowPoolPtr pool = arg;
+    unsigned long generation;
+    unsigned long written;
+    int band, yMin, yMax;
+
+    pthread_mutex_lock(&pool->lock);
+    band = ++pool->running;
+    generation = pool->generation;
+    pthread_cond_signal(&pool->done);
+
+    for (;;) {
+	while (!pool->quit && pool->generation == generation)
+	    pthread_cond_wait(&pool->start, &pool->lock);
+	if (pool->quit)
+	    break;
+	generation = pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+
+	VERMILIONShadowBand(pool, band, &yMin, &yMax);
+	written = VERMILIONShadowCopy(pool->pVermilion, pool->pShadow,
+	    pool->pbox, pool->nbox, yMin, yMax,
+	    pool->pVermilion->shadowCopyRow);
+	/* A fence only covers the stores of the CPU executing it. */
+	if (pool->pVermilion->shadowFence)
+	    pool->pVermilion->shadowFence();
+
+	pthread_mutex_lock(&pool->lock);
+	pool->written += written;
+	if (--pool->busy == 0)
+	    pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void
+VERMILIONShadowPoolDestroy(VERMILIONShadowPoolPtr pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nThreads; i++)
+	pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    xfree(pool->threads);
+    xfree(pool);
+}
+
+static VERMILIONShadowPoolPtr
+VERMILIONShadowPoolCreate(int nThreads)
+{
+    VERMILIONShadowPoolPtr pool;
+    int i;
+
+    pool = xcalloc(1, sizeof(*pool));
+    if (!pool)
+	return NULL;
+    pool->threads = xcalloc(nThreads, sizeof(pthread_t));
+    if (!pool->threads) {
+	xfree(pool);
+	return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < nThreads; i++) {
+	if (VERMILIONCreateThread(&pool->threads[i], VERMILIONShadowWorker,
+		pool) != 0)
+	    break;
+	pool->nThreads++;
+    }
+
+    if (pool->nThreads == 0) {
+	VERMILIONShadowPoolDestroy(pool);
+	return NULL;
+    }
+
+    /* Band numbers are assigned as the workers start up. */
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running < pool->nThreads)
+	pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool;
+}
+
+/*
+ * Upload a set of boxes, spreading large flushes over the worker pool.
+ */
+
+static unsigned long
+VERMILIONShadowCopyBoxes(VERMILIONPtr pVermilion, PixmapPtr pShadow,
+    BoxPtr pbox, int nbox)
+{
+    VERMILIONShadowPoolPtr pool = pVermilion->shadowPool;
+    unsigned long pixels = 0;
+    unsigned long written;
+    int y1 = MAXSHORT, y2 = 0;
+    int i, yMin, yMax;
+
+    if (pool) {
+	for (i = 0; i < nbox; i++) {
+	    pixels += (unsigned long)(pbox[i].x2 - pbox[i].x1) *
+		(pbox[i].y2 - pbox[i].y1);
+	    y1 = min(y1, pbox[i].y1);
+	    y2 = max(y2, pbox[i].y2);
+	}
+    }
+
+    if (!pool || pixels < VERMILION_SHADOW_THREAD_MIN ||
+	y2 - y1 <= pool->nThreads)
+	return VERMILIONShadowCopy(pVermilion, pShadow, pbox, nbox, 0,
+	    MAXSHORT, pVermilion->shadowCopyRow);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pVermilion = pVermilion;
+    pool->pShadow = pShadow;
+    pool->pbox = pbox;
+    pool->nbox = nbox;
+    pool->y1 = y1;
+    pool->y2 = y2;
+    pool->written = 0;
+    pool->busy = pool->nThreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    VERMILIONShadowBand(pool, 0, &yMin, &yMax);
+    written = VERMILIONShadowCopy(pVermilion, pShadow, pbox, nbox, yMin, yMax,
+	pVermilion->shadowCopyRow);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+	pthread_cond_wait(&pool->done, &pool->lock);
+    written += pool->written;
+    pthread_mutex_unlock(&pool->lock);
+
+    return written;
+}
+
+/*
+ * Hooks that send the staging copies and fences to the MBX.
+ */
+
+static void
+VERMILIONShadowStageUpload(void *closure, CARD32 srcAddr, int pitch, int x,
+    int y, int w, int h)
+{
+    VERMILIONMBXUpload(closure, srcAddr, pitch, x, y, w, h);
+}
+
+static CARD32
+VERMILIONShadowStageEmitSeq(void *closure)
+{
+    return VERMILIONMBXEmitSeq(closure);
+}
+
+static void
+VERMILIONShadowStageWaitSeq(void *closure, CARD32 seq)
+{
+    VERMILIONMBXWaitSeq(closure, seq);
+}
+
+/*
+ * Carve the ShadowMBX staging halves and their fences out of the VRAM
+ * between the visible framebuffer and the MBX fence slots. The CPU writes
+ * as many bytes to VRAM as it does uploading directly, so all staging
+ * buys is contiguous writes, at the price of an MBX copy.
+ */
+
+static VERMILIONShadowStagePtr
+VERMILIONShadowStageCreate(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowStagePtr stage;
+    unsigned long base, top, size;
+    int i;
+
+    if (!VERMILIONMBXInit(pScrn)) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+	    "The MBX can't place depth %d shadow updates.\n", pScrn->depth);
+	return NULL;
+    }
+
+    base = ALIGN_TO(pScrn->virtualY * pVermilion->stride, 4096);
+    top = pVermilion->fbSize - MBX_SYNC_MAP_SIZE;
+    size = 0;
+    if (top > base)
+	size = min((top - base) / 2, VERMILION_STAGE_SIZE) &
+	    ~(VERMILION_STAGE_ALIGN - 1);
+
+    if (size < pVermilion->stride + VERMILION_STAGE_ALIGN) {
+	xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+	    "Not enough offscreen memory to stage shadow updates for "
+	    "the MBX.\n");
+	return NULL;
+    }
+
+    stage = xcalloc(1, sizeof(*stage));
+    if (!stage)
+	return NULL;
+
+    stage->size = size;
+    stage->upload = VERMILIONShadowStageUpload;
+    stage->emitSeq = VERMILIONShadowStageEmitSeq;
+    stage->waitSeq = VERMILIONShadowStageWaitSeq;
+    stage->closure = pScrn;
+    for (i = 0; i < 2; i++) {
+	stage->map[i] = (char *)pVermilion->fbMap + base + i * size;
+	stage->devAddr[i] = pVermilion->mbxFBDevAddr + base + i * size;
+	stage->seq[i] = VERMILIONMBXEmitSeq(pScrn);
+    }
+
+    return stage;
+}
+
+static unsigned long
+VERMILIONShadowStageBoxes(ScrnInfoPtr pScrn, PixmapPtr pShadow, BoxPtr pbox,
+    int nbox)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    FbBits *shaBase;
+    FbStride shaStride;
+    int shaBpp;
+    int shaXoff, shaYoff;	       /* XXX assumed to be zero */
+
+    fbGetDrawable(&pShadow->drawable, shaBase, shaStride, shaBpp, shaXoff,
+	shaYoff);
+
+    return VERMILIONShadowStageBits(pVermilion->shadowStage, shaBase,
+	shaStride, shaBpp, pScrn->displayWidth, pbox, nbox,
+	pVermilion->shadowCopyRow, pVermilion->shadowFence);
+}
+
+/*
+ * Upload a snapshot of the damage. Runs on the server thread, or on the
+ * flusher thread with ShadowAsync.
+ */
+
+static void
+VERMILIONShadowFlush(ScrnInfoPtr pScrn, PixmapPtr pShadow, BoxPtr pbox,
+    int nbox)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowStatsPtr stats = &pVermilion->shadowStats;
+    unsigned long long start;
+    unsigned long written;
+
+    start = VERMILIONShadowUsecs();
+
+    if (pVermilion->shadowTileHash) {
+	nbox = VERMILIONShadowFilterTiles(pScrn, pShadow, pbox, nbox);
+	pbox = pVermilion->shadowTileBoxes;
+    }
+
+    if (pVermilion->shadowStage)
+	written = VERMILIONShadowStageBoxes(pScrn, pShadow, pbox, nbox);
+    else
+	written = VERMILIONShadowCopyBoxes(pVermilion, pShadow, pbox, nbox);
+
+    /*
+     * One fence per flush makes the streaming stores globally visible
+     * before the shadow layer goes back to the clients.
+     */
+    if (pVermilion->shadowFence)
+	pVermilion->shadowFence();
+
+    stats->usecs += VERMILIONShadowUsecs() - start;
+    stats->bytes += (unsigned long long)written * sizeof(FbBits);
+    stats->flushes++;
+}
+
+static void *
+VERMILIONShadowFlusher(void *arg)
+{
+    VERMILIONShadowAsyncPtr async = arg;
+    VERMILIONShadowStatsPtr stats =
+	&VERMILIONPTR(async->pScrn)->shadowStats;
+    unsigned long long since;
+    BoxPtr boxes;
+    int nbox, size;
+
+    /* ShadowMBX waits for the MBX from here; see vermilion_wait.c. */
+    VERMILIONWaitThreadStats(async->waitStats);
+
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+	while (!async->quit && !async->nPending)
+	    pthread_cond_wait(&async->wake, &async->lock);
+	if (async->quit)
+	    break;
+
+	boxes = async->pending;
+	size = async->pendingSize;
+	nbox = async->nPending;
+	since = async->pendingSince;
+	async->pending = async->active;
+	async->pendingSize = async->activeSize;
+	async->nPending = 0;
+	async->active = boxes;
+	async->activeSize = size;
+	async->busy = TRUE;
+	pthread_mutex_unlock(&async->lock);
+
+	VERMILIONShadowFlush(async->pScrn, async->pShadow, boxes, nbox);
+
+	pthread_mutex_lock(&async->lock);
+	stats->latencyUsecs += VERMILIONShadowUsecs() - since;
+	stats->latencyCount++;
+	async->busy = FALSE;
+	if (!async->nPending)
+	    pthread_cond_broadcast(&async->idle);
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    return NULL;
+}
+
+static void
+VERMILIONShadowAsyncDestroy(VERMILIONShadowAsyncPtr async)
+{
+    pthread_mutex_lock(&async->lock);
+    while (async->busy || async->nPending)
+	pthread_cond_wait(&async->idle, &async->lock);
+    async->quit = TRUE;
+    pthread_cond_signal(&async->wake);
+    pthread_mutex_unlock(&async->lock);
+
+    pthread_join(async->thread, NULL);
+    VERMILIONWaitMerge(async->pScrn, async->waitStats);
+
+    pthread_cond_destroy(&async->idle);
+    pthread_cond_destroy(&async->wake);
+    pthread_mutex_destroy(&async->lock);
+    xfree(async->pending);
+    xfree(async->active);
+    xfree(async);
+}
+
+static VERMILIONShadowAsyncPtr
+VERMILIONShadowAsyncCreate(ScrnInfoPtr pScrn)
+{
+    VERMILIONShadowAsyncPtr async;
+    int ret;
+
+    async = xcalloc(1, sizeof(*async));
+    if (!async)
+	return NULL;
+
+    async->pScrn = pScrn;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->wake, NULL);
+    pthread_cond_init(&async->idle, NULL);
+
+    ret = VERMILIONCreateThread(&async->thread, VERMILIONShadowFlusher, async);
+
+    if (ret != 0) {
+	pthread_cond_destroy(&async->idle);
+	pthread_cond_destroy(&async->wake);
+	pthread_mutex_destroy(&async->lock);
+	xfree(async);
+	return NULL;
+    }
+
+    return async;
+}
+
+/*
+ * Hand a damage snapshot to the flusher thread. If the pending list would
+ * grow past VERMILION_SHADOW_ASYNC_MAX_BOXES because the flusher can't keep
+ * up, or because one damage region has that many boxes, collapse it to its
+ * extents.
+ */
+
+static void
+VERMILIONShadowQueue(VERMILIONShadowAsyncPtr async, PixmapPtr pShadow,
+    BoxPtr pbox, int nbox, unsigned long long since)
+{
+    BoxRec extents;
+    int i, want;
+
+    pthread_mutex_lock(&async->lock);
+    async->pShadow = pShadow;
+    if (!async->nPending)
+	async->pendingSince = since;
+
+    /* Room for everything, or for the extents box if that's too much */
+    want = async->nPending + nbox;
+    if (want > VERMILION_SHADOW_ASYNC_MAX_BOXES)
+	want = 1;
+
+    if (want > async->pendingSize) {
+	BoxPtr boxes = xrealloc(async->pending, want * sizeof(BoxRec));
+
+	if (boxes) {
+	    async->pending = boxes;
+	    async->pendingSize = want;
+	}
+    }
+
+    if (async->nPending + nbox <= async->pendingSize) {
+	memcpy(async->pending + async->nPending, pbox, nbox * sizeof(BoxRec));
+	async->nPending += nbox;
+    } else if (async->pendingSize > 0) {
+	extents = *pbox;
+	for (i = 0; i < async->nPending; i++) {
+	    extents.x1 = min(extents.x1, async->pending[i].x1);
+	    extents.y1 = min(extents.y1, async->pending[i].y1);
+	    extents.x2 = max(extents.x2, async->pending[i].x2);
+	    extents.y2 = max(extents.y2, async->pending[i].y2);
+	}
+	for (i = 0; i < nbox; i++) {
+	    extents.x1 = min(extents.x1, pbox[i].x1);
+	    extents.y1 = min(extents.y1, pbox[i].y1);
+	    extents.x2 = max(extents.x2, pbox[i].x2);
+	    extents.y2 = max(extents.y2, pbox[i].y2);
+	}
+	async->pending[0] = extents;
+	async->nPending = 1;
+    } else {
+	/* Not even room for the extents; upload it ourselves. */
+	pthread_mutex_unlock(&async->lock);
+	VERMILIONShadowSync(async->pScrn);
+	VERMILIONShadowFlush(async->pScrn, pShadow, pbox, nbox);
+	return;
+    }
+
+    pthread_cond_signal(&async->wake);
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void
+VERMILIONUpdatePacked(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONShadowStatsPtr stats = &pVermilion->shadowStats;
+    RegionPtr damage = &pBuf->damage;
+    int nbox = REGION_NUM_RECTS(damage);
+    BoxPtr pbox = REGION_RECTS(damage);
+    unsigned long long start;
+
+    /* Nothing may touch the framebuffer while we're switched away. */
+    if (!pScrn->vtSema)
+	return;
+
+    start = VERMILIONShadowUsecs();
+
+    stats->boxesIn += nbox;
+    if (pVermilion->shadowCoalesce > 0 && nbox > 1) {
+	if (nbox > pVermilion->shadowBoxesSize) {
+	    BoxPtr boxes = xrealloc(pVermilion->shadowBoxes,
+		nbox * sizeof(BoxRec));
+
+	    if (boxes) {
+		pVermilion->shadowBoxes = boxes;
+		pVermilion->shadowBoxesSize = nbox;
+	    }
+	}
+	if (nbox <= pVermilion->shadowBoxesSize) {
+	    nbox = VERMILIONShadowCoalesce(pVermilion, pbox, nbox);
+	    pbox = pVermilion->shadowBoxes;
+	}
+    }
+    stats->boxesOut += nbox;
+
+    if (pVermilion->shadowAsyncRec) {
+	VERMILIONShadowQueue(pVermilion->shadowAsyncRec, pBuf->pPixmap,
+	    pbox, nbox, start);
+	VERMILIONWaitCheck(pScrn);
+    } else {
+	VERMILIONShadowFlush(pScrn, pBuf->pPixmap, pbox, nbox);
+	stats->latencyUsecs += VERMILIONShadowUsecs() - start;
+	stats->latencyCount++;
+    }
+
+    stats->stallUsecs += VERMILIONShadowUsecs() - start;
+    stats->updates++;
+}
+
+/*
+ * The depth specific part lives in pVermilion->shadowCopyRow, these are
+ * kept as separate entry points for the shadow layer.
+ */
+
+void
+VERMILIONUpdatePackedDepth15(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+    VERMILIONUpdatePacked(pScreen, pBuf);
+}
+
+void
+VERMILIONUpdatePackedDepth24(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+    VERMILIONUpdatePacked(pScreen, pBuf);
+}
@@ -0,0 +1,356 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+
+#include "vermilion.h"
+#include "vermilion_mbx.h"
+
+/*
+ * MBX submission thread, enabled with Option "AccelThread". The server
+ * thread still encodes packets into pVermilion->cmdBuf, but
+ * MBXFlushCommands() hands them to VERMILIONSubmitPush() instead of
+ * writing the slave port. The submission thread owns the slave port and
+ * the FIFO bookkeeping (FifoSlots, cmdBursts, cmdStatusReads) and does
+ * the waiting for FIFO space, so the server can go back to dispatching
+ * clients while the MBX drains. Fences and waits work as before, since
+ * they only look at the fence slots in VRAM.
+ *
+ * The ring between the two is single producer, single consumer, with free
+ * running head and tail counters. Only the producer writes head and only
+ * the consumer writes tail, so neither side takes a lock to move data.
+ * The lock and condition are only used to put the thread to sleep when
+ * the ring is empty and to wake it up again.
+ *
+ * If the MBX stops, the thread keeps waiting for FIFO space, noting a
+ * timeout every VERMILION_WAIT_FIFO period, until it's told to quit or to
+ * discard the ring. The ring meanwhile fills up and VERMILIONSubmitPush()
+ * starts dropping whole flushes, see there.
+ */
+
+#define VERMILION_RING_SIZE 32768	/* dwords, a power of two */
+#define VERMILION_RING_MASK (VERMILION_RING_SIZE - 1)
+
+typedef struct _VERMILIONSubmit
+{
+    CARD32 ring[VERMILION_RING_SIZE];
+    volatile CARD32 head;
+    volatile CARD32 tail;
+    volatile Bool sleeping;
+    volatile Bool quit;
+    volatile Bool discard;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    ScrnInfoPtr pScrn;
+    unsigned long wakeups;
+    VERMILIONWaitStatsRec waitStats[VERMILION_NUM_WAITS];
+
+    /* Producer side */
+    Bool dropping;
+    CARD32 owed;		       /* host data the MBX still expects */
+    unsigned long drops;
+} VERMILIONSubmitRec;
+
+static Bool
+vermilionSubmitFifoReady(ScrnInfoPtr pScrn, void *arg)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+
+    MBXReadFifoSpace(pVermilion);
+    return pVermilion->FifoSlots != 0;
+}
+
+/*
+ * Wait for free FIFO slots. Returns FALSE if a wait timed out after we
+ * were told to quit or to discard the ring.
+ */
+
+static Bool
+vermilionSubmitWaitFifo(VERMILIONSubmitPtr submit)
+{
+    while (!VERMILIONWait(submit->pScrn, VERMILION_WAIT_FIFO,
+	    vermilionSubmitFifoReady, NULL)) {
+	if (submit->quit || submit->discard)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void *
+vermilionSubmitThread(void *arg)
+{
+    VERMILIONSubmitPtr submit = arg;
+    VERMILIONPtr pVermilion = VERMILIONPTR(submit->pScrn);
+    CARD32 tail, n;
+
+    VERMILIONWaitThreadStats(submit->waitStats);
+
+    for (;;) {
+	tail = submit->tail;
+
+	if (tail == submit->head) {
+	    pthread_mutex_lock(&submit->lock);
+	    submit->sleeping = TRUE;
+	    __sync_synchronize();
+	    while (submit->tail == submit->head && !submit->quit)
+		pthread_cond_wait(&submit->wake, &submit->lock);
+	    submit->sleeping = FALSE;
+	    if (submit->tail == submit->head && submit->quit) {
+		pthread_mutex_unlock(&submit->lock);
+		break;
+	    }
+	    submit->wakeups++;
+	    pthread_mutex_unlock(&submit->lock);
+	    continue;
+	}
+
+	/* Read the packets only after seeing the head that covers them. */
+	__sync_synchronize();
+
+	n = min(submit->head - tail,
+	    VERMILION_RING_SIZE - (tail & VERMILION_RING_MASK));
+	if (!pVermilion->FifoSlots && !vermilionSubmitWaitFifo(submit)) {
+	    /* The MBX is gone; abandon the rest. */
+	    submit->tail = submit->head;
+	    if (submit->quit)
+		break;
+	    continue;
+	}
+	n = min(n, pVermilion->FifoSlots);
+
+	MBXWriteSlavePortBatch(pVermilion,
+	    &submit->ring[tail & VERMILION_RING_MASK], n);
+	pVermilion->FifoSlots -= n;
+	pVermilion->cmdBursts++;
+
+	__sync_synchronize();
+	submit->tail = tail + n;
+    }
+
+    return NULL;
+}
+
+static Bool
+vermilionSubmitHasSpace(ScrnInfoPtr pScrn, void *arg)
+{
+    VERMILIONSubmitPtr submit = VERMILIONPTR(pScrn)->mbxSubmit;
+
+    return VERMILION_RING_SIZE - (submit->head - submit->tail) >=
+	*(CARD32 *) arg;
+}
+
+/*
+ * Copy n dwords into the ring, or n zero dwords if cmd is NULL, once
+ * there's room for them. n is at most VERMILION_CMD_BUF_SIZE.
+ */
+
+static Bool
+vermilionSubmitCopy(VERMILIONPtr pVermilion, const CARD32 *cmd, CARD32 n)
+{
+    VERMILIONSubmitPtr submit = pVermilion->mbxSubmit;
+    CARD32 head = submit->head;
+    CARD32 first;
+
+    if (!VERMILIONWait(pVermilion->pScrn, VERMILION_WAIT_RING,
+	    vermilionSubmitHasSpace, &n))
+	return FALSE;
+
+    first = min(n, VERMILION_RING_SIZE - (head & VERMILION_RING_MASK));
+    if (cmd) {
+	memcpy(&submit->ring[head & VERMILION_RING_MASK], cmd,
+	    first * sizeof(CARD32));
+	memcpy(submit->ring, cmd + first, (n - first) * sizeof(CARD32));
+    } else {
+	memset(&submit->ring[head & VERMILION_RING_MASK], 0,
+	    first * sizeof(CARD32));
+	memset(submit->ring, 0, (n - first) * sizeof(CARD32));
+    }
+
+    /* Publish the packets before the head, then check for a sleeper. */
+    __sync_synchronize();
+    submit->head = head + n;
+    __sync_synchronize();
+
+    if (submit->sleeping) {
+	pthread_mutex_lock(&submit->lock);
+	pthread_cond_signal(&submit->wake);
+	pthread_mutex_unlock(&submit->lock);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Finish the host data blit the MBX was left in the middle of with
+ * filler, so that it takes what follows as block headers again.
+ */
+
+static Bool
+vermilionSubmitFill(VERMILIONPtr pVermilion, CARD32 owed)
+{
+    CARD32 fence = MBX2D_FENCE_BH;
+    CARD32 n;
+
+    while (owed) {
+	n = min(owed, VERMILION_CMD_BUF_SIZE);
+	if (!vermilionSubmitCopy(pVermilion, NULL, n))
+	    return FALSE;
+	owed -= n;
+    }
+
+    return vermilionSubmitCopy(pVermilion, &fence, 1);
+}
+
+/*
+ * Queue n dwords of packets for the submission thread. Called from
+ * MBXFlushCommands(), so n is at most VERMILION_CMD_BUF_SIZE.
+ *
+ * Flushes don't end on packet boundaries when they cut host data blits
+ * up, so once the ring has stayed full too long and a flush had to be
+ * dropped, so is every flush after it that starts in the middle of a
+ * blit (cmdOwed). The first one that doesn't goes in only after filler
+ * for whatever the MBX is still owed by the last blit it saw the start
+ * of. All dropped packets' fences are written off.
+ */
+
+void
+VERMILIONSubmitPush(VERMILIONPtr pVermilion, const CARD32 *cmd, CARD32 n)
+{
+    VERMILIONSubmitPtr submit = pVermilion->mbxSubmit;
+
+    if (submit->dropping) {
+	if (pVermilion->cmdOwed ||
+	    !vermilionSubmitFill(pVermilion, submit->owed))
+	    goto drop;
+	submit->dropping = FALSE;
+	submit->owed = 0;
+    }
+
+    if (!vermilionSubmitCopy(pVermilion, cmd, n)) {
+	submit->dropping = TRUE;
+	goto drop;
+    }
+
+    submit->owed = pVermilion->hostOwed;
+    return;
+
+  drop:
+    submit->drops++;
+    pVermilion->mbxSeqRetired = pVermilion->mbxSeqEmitted;
+    pVermilion->mbxStateValid = 0;
+}
+
+VERMILIONSubmitPtr
+VERMILIONSubmitCreate(ScrnInfoPtr pScrn)
+{
+    VERMILIONSubmitPtr submit;
+    int ret;
+
+    submit = xcalloc(1, sizeof(*submit));
+    if (!submit)
+	return NULL;
+
+    submit->pScrn = pScrn;
+    pthread_mutex_init(&submit->lock, NULL);
+    pthread_cond_init(&submit->wake, NULL);
+
+    ret = VERMILIONCreateThread(&submit->thread, vermilionSubmitThread,
+	submit);
+
+    if (ret != 0) {
+	pthread_cond_destroy(&submit->wake);
+	pthread_mutex_destroy(&submit->lock);
+	xfree(submit);
+	return NULL;
+    }
+
+    return submit;
+}
+
+static Bool
+vermilionSubmitIdle(ScrnInfoPtr pScrn, void *arg)
+{
+    VERMILIONSubmitPtr submit = arg;
+
+    return submit->tail == submit->head && submit->sleeping;
+}
+
+/*
+ * Let the thread write out what's left in the ring and wait for it to go
+ * to sleep, so that the FIFO bookkeeping it owns can be reset. If the MBX
+ * has stopped taking commands, the rest of the ring is thrown away once
+ * the thread's FIFO wait times out.
+ */
+
+void
+VERMILIONSubmitDrain(VERMILIONSubmitPtr submit)
+{
+    if (!VERMILIONWait(submit->pScrn, VERMILION_WAIT_RING,
+	    vermilionSubmitIdle, submit)) {
+	submit->discard = TRUE;
+	while (!VERMILIONWait(submit->pScrn, VERMILION_WAIT_RING,
+		vermilionSubmitIdle, submit))
+	    ;
+	submit->discard = FALSE;
+    }
+
+    submit->dropping = FALSE;
+    submit->owed = 0;
+}
+
+/*
+ * Let the thread write out what's left in the ring, then stop it. If the
+ * MBX has stopped, the thread gives up after one more FIFO timeout.
+ */
+
+void
+VERMILIONSubmitDestroy(VERMILIONSubmitPtr submit)
+{
+    pthread_mutex_lock(&submit->lock);
+    submit->quit = TRUE;
+    pthread_cond_signal(&submit->wake);
+    pthread_mutex_unlock(&submit->lock);
+
+    pthread_join(submit->thread, NULL);
+    VERMILIONWaitMerge(submit->pScrn, submit->waitStats);
+
+    xf86DrvMsg(submit->pScrn->scrnIndex, X_INFO,
+	"MBX: submission thread woke up %lu times, %lu flushes dropped.\n",
+	submit->wakeups, submit->drops);
+
+    pthread_cond_destroy(&submit->wake);
+    pthread_mutex_destroy(&submit->lock);
+    xfree(submit);
+}
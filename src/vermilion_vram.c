@@ -0,0 +1,141 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "vermilion_kernel.h"
+#ifdef VERMILION_TEST
+#include "vermilion_test.h"
+#include "vermilion_heap.h"
+#include "vermilion_vram.h"
+#else
+#include "vermilion.h"
+#endif
+
+/*
+ * Ask the kernel for VRAM past the contiguous part, chunk 1 first, and
+ * fill in up to VERMILION_MAX_VRAM_CHUNKS of them. Running out of chunks
+ * fails with EINVAL, and kernels that don't know about chunks fail with
+ * ENOTTY, which just means there are none. Any other failure stops the
+ * query with the chunks found so far and is returned in *err, 0 if there
+ * was none. Returns the number of chunks.
+ */
+
+int
+VERMILIONVRAMQueryChunks(VERMILIONIoctlProc ioctlProc, void *closure,
+    VERMILIONVRAMChunkPtr chunks, int *err)
+{
+    VERMILIONVRAMChunkPtr chunk;
+    vml_vram_chunk_t arg;
+    int n = 0;
+
+    *err = 0;
+
+    while (n < VERMILION_MAX_VRAM_CHUNKS) {
+	memset(&arg, 0, sizeof(arg));
+	arg.index = n + 1;
+	if ((*ioctlProc) (closure, VML_VRAM_CHUNK, &arg) != 0) {
+	    if (errno != EINVAL && errno != ENOTTY)
+		*err = errno;
+	    break;
+	}
+	if (!arg.size)
+	    break;
+
+	chunk = &chunks[n++];
+	chunk->devAddr = arg.phys_offset;
+	chunk->size = arg.size;
+	chunk->mmapOffset = arg.mmap_offset;
+	chunk->map = NULL;
+    }
+
+    return n;
+}
+
+/*
+ * The heap only aligns offsets, so a piece of VRAM that doesn't start on
+ * an aligned device address gets a pool based at the first one that is.
+ */
+
+static int
+vramAddPool(VERMILIONPoolPtr pool, CARD8 *map, CARD32 devAddr,
+    unsigned long start, unsigned long end, unsigned long align,
+    VERMILIONHeapEvictProc evict, void *closure)
+{
+    unsigned long skew = (align - devAddr % align) % align;
+
+    start = (start > skew ? start : skew) - skew;
+    end = (end > skew ? end : skew) - skew;
+    map += skew;
+    devAddr += skew;
+
+    if (end <= start)
+	return 0;
+
+    pool->heap = VERMILIONHeapCreate(start, end - start, align, evict,
+	closure);
+    if (!pool->heap)
+	return 0;
+
+    pool->map = map;
+    pool->devAddr = devAddr;
+    return 1;
+}
+
+/*
+ * A pool for each piece of VRAM: the offscreen range [start, end) of the
+ * framebuffer, then the chunks that got mapped. Empty ranges and ones the heap can't be set up for are left
+ * out. Returns the number of pools, at most VERMILION_MAX_POOLS.
+ */
+
+int
+VERMILIONVRAMInitPools(VERMILIONPoolPtr pools, CARD8 *fbMap, CARD32 fbDevAddr,
+    unsigned long start, unsigned long end,
+    const VERMILIONVRAMChunkRec * chunks, int numChunks, unsigned long align,
+    VERMILIONHeapEvictProc evict, void *closure)
+{
+    int n = 0, i;
+
+    n += vramAddPool(&pools[n], fbMap, fbDevAddr, start, end, align,
+	evict, closure);
+
+    for (i = 0; i < numChunks && n < VERMILION_MAX_POOLS; i++) {
+	if (!chunks[i].map)
+	    continue;
+	n += vramAddPool(&pools[n], chunks[i].map, chunks[i].devAddr, 0,
+	    chunks[i].size, align, evict, closure);
+    }
+
+    return n;
+}
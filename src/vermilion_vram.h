@@ -0,0 +1,81 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef _VERMILION_VRAM_H_
+#define _VERMILION_VRAM_H_
+
+/*
+ * VRAM chunks and the pixmap pools over them, see vermilion_vram.c. Like
+ * the heap this doesn't depend on the server; the device is only reached
+ * through an ioctl hook. Needs the X types, or the stubs in tests/, and
+ * vermilion_heap.h included first.
+ */
+
+/*
+ * VRAM that isn't contiguous with the framebuffer, see VML_VRAM_CHUNK in
+ * vermilion_kernel.h.
+ */
+#define VERMILION_MAX_VRAM_CHUNKS 8
+
+typedef struct _VERMILIONVRAMChunk
+{
+    CARD32 devAddr;
+    unsigned long size;
+    unsigned long mmapOffset;
+    CARD8 *map;
+} VERMILIONVRAMChunkRec, *VERMILIONVRAMChunkPtr;
+
+/*
+ * A heap of offscreen pixmaps over one piece of VRAM. Heap offsets are
+ * relative to map for the CPU and to devAddr for the MBX.
+ */
+#define VERMILION_MAX_POOLS (1 + VERMILION_MAX_VRAM_CHUNKS)
+
+typedef struct _VERMILIONPool
+{
+    VERMILIONHeapPtr heap;
+    CARD8 *map;
+    CARD32 devAddr;
+} VERMILIONPoolRec, *VERMILIONPoolPtr;
+
+/*
+ * ioctl() on the device: returns -1 and sets errno on failure.
+ */
+typedef int (*VERMILIONIoctlProc) (void *closure, unsigned long request,
+    void *arg);
+
+extern int VERMILIONVRAMQueryChunks(VERMILIONIoctlProc ioctlProc,
+    void *closure, VERMILIONVRAMChunkPtr chunks, int *err);
+extern int VERMILIONVRAMInitPools(VERMILIONPoolPtr pools, CARD8 * fbMap,
+    CARD32 fbDevAddr, unsigned long start, unsigned long end,
+    const VERMILIONVRAMChunkRec * chunks, int numChunks, unsigned long align,
+    VERMILIONHeapEvictProc evict, void *closure);
+
+#endif /* _VERMILION_VRAM_H_ */
@@ -0,0 +1,260 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "vermilion.h"
+
+/*
+ * Waiting for the hardware. The condition is polled VERMILION_WAIT_SPIN
+ * times back to back, since most waits are over within a few register
+ * reads. After that the server sleeps between polls, starting at 1 us and
+ * doubling up to VERMILION_WAIT_SLEEP_MAX. A wait that doesn't finish in
+ * its site's timeout is logged and given up on; the caller decides how to
+ * carry on.
+ */
+
+#define VERMILION_WAIT_SPIN 64
+#define VERMILION_WAIT_SLEEP_MAX 1000	/* usecs */
+
+/*
+ * Waits also happen on the ShadowAsync flusher thread and the AccelThread
+ * submission thread. Those mustn't log, or share statistics with the
+ * server thread, so each keeps statistics of its own, set with
+ * VERMILIONWaitThreadStats() and added to the server's with
+ * VERMILIONWaitMerge() once the thread is gone. Their timeouts are only
+ * counted in waitLost, for the server thread to log from
+ * VERMILIONWaitCheck().
+ */
+static __thread VERMILIONWaitStatsPtr vermilionThreadStats;
+
+static const struct
+{
+    const char *name;
+    unsigned long timeout;	       /* usecs */
+} vermilionWaitSites[VERMILION_NUM_WAITS] = {
+    {"MBX FIFO", 1000000},
+    {"MBX fence", 1000000},
+    {"MBX submission ring", 1000000},
+    {"MDVO pad off", 100000},
+    {"MDVO pad on", 100000},
+};
+
+unsigned long long
+VERMILIONUsecs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+vermilionWaitRecord(VERMILIONWaitStatsPtr stats, unsigned long long usecs)
+{
+    int bucket = 0;
+
+    while (bucket < VERMILION_WAIT_BUCKETS - 1 && usecs >= (1ULL << bucket))
+	bucket++;
+
+    stats->count++;
+    stats->usecs += usecs;
+    stats->hist[bucket]++;
+}
+
+/*
+ * Wait until done(pScrn, arg) returns TRUE. Returns FALSE if the site's
+ * timeout ran out first.
+ */
+
+Bool
+VERMILIONWait(ScrnInfoPtr pScrn, VERMILIONWaitSite site,
+    VERMILIONWaitProc done, void *arg)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONWaitStatsPtr stats = vermilionThreadStats ?
+	&vermilionThreadStats[site] : &pVermilion->waitStats[site];
+    unsigned long long start, elapsed;
+    unsigned long sleep = 1;
+    int i;
+
+    if (done(pScrn, arg)) {
+	vermilionWaitRecord(stats, 0);
+	return TRUE;
+    }
+
+    start = VERMILIONUsecs();
+
+    for (i = 0; i < VERMILION_WAIT_SPIN; i++) {
+	if (done(pScrn, arg)) {
+	    vermilionWaitRecord(stats, VERMILIONUsecs() - start);
+	    return TRUE;
+	}
+    }
+
+    for (;;) {
+	usleep(sleep);
+	if (sleep < VERMILION_WAIT_SLEEP_MAX)
+	    sleep = min(sleep * 2, VERMILION_WAIT_SLEEP_MAX);
+
+	elapsed = VERMILIONUsecs() - start;
+	if (done(pScrn, arg)) {
+	    vermilionWaitRecord(stats, elapsed);
+	    return TRUE;
+	}
+	if (elapsed >= vermilionWaitSites[site].timeout)
+	    break;
+    }
+
+    vermilionWaitRecord(stats, elapsed);
+    stats->timeouts++;
+
+    if (vermilionThreadStats) {
+	__sync_fetch_and_add(&pVermilion->waitLost[site], 1);
+	return FALSE;
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+	"Timed out waiting for %s after %llu ms.\n",
+	vermilionWaitSites[site].name, elapsed / 1000);
+
+    return FALSE;
+}
+
+void
+VERMILIONWaitThreadStats(VERMILIONWaitStatsPtr stats)
+{
+    vermilionThreadStats = stats;
+}
+
+void
+VERMILIONWaitMerge(ScrnInfoPtr pScrn, VERMILIONWaitStatsPtr stats)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONWaitStatsPtr to;
+    int site, bucket;
+
+    for (site = 0; site < VERMILION_NUM_WAITS; site++) {
+	to = &pVermilion->waitStats[site];
+	to->count += stats[site].count;
+	to->timeouts += stats[site].timeouts;
+	to->usecs += stats[site].usecs;
+	for (bucket = 0; bucket < VERMILION_WAIT_BUCKETS; bucket++)
+	    to->hist[bucket] += stats[site].hist[bucket];
+    }
+}
+
+/*
+ * Log the timeouts helper threads have had since the last call. Server
+ * thread only.
+ */
+
+void
+VERMILIONWaitCheck(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    int site, lost;
+
+    for (site = 0; site < VERMILION_NUM_WAITS; site++) {
+	if (!pVermilion->waitLost[site])
+	    continue;
+	lost = __sync_fetch_and_and(&pVermilion->waitLost[site], 0);
+	if (lost)
+	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		"Timed out waiting for %s %d time%s on a helper thread.\n",
+		vermilionWaitSites[site].name, lost, lost == 1 ? "" : "s");
+    }
+}
+
+/*
+ * Log how long each kind of wait took, as a histogram with power of two
+ * buckets.
+ */
+
+void
+VERMILIONWaitReport(ScrnInfoPtr pScrn)
+{
+    VERMILIONPtr pVermilion = VERMILIONPTR(pScrn);
+    VERMILIONWaitStatsPtr stats;
+    char buf[VERMILION_WAIT_BUCKETS * 24];
+    int site, bucket, len;
+
+    VERMILIONWaitCheck(pScrn);
+
+    for (site = 0; site < VERMILION_NUM_WAITS; site++) {
+	stats = &pVermilion->waitStats[site];
+	if (!stats->count)
+	    continue;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "%s: %lu waits, %.1f us average, %lu timeouts.\n",
+	    vermilionWaitSites[site].name, stats->count,
+	    (double)stats->usecs / (double)stats->count, stats->timeouts);
+
+	len = 0;
+	buf[0] = '\0';
+	for (bucket = 0; bucket < VERMILION_WAIT_BUCKETS; bucket++) {
+	    if (!stats->hist[bucket])
+		continue;
+	    len += snprintf(buf + len, sizeof(buf) - len, " %s%lu us: %lu",
+		bucket == VERMILION_WAIT_BUCKETS - 1 ? ">=" : "<",
+		bucket == VERMILION_WAIT_BUCKETS - 1 ?
+		1UL << (bucket - 1) : 1UL << bucket, stats->hist[bucket]);
+	}
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "%s:%s\n",
+	    vermilionWaitSites[site].name, buf);
+    }
+}
+
+/*
+ * Start a helper thread running proc(arg). The thread is created with all
+ * signals blocked, so that the server's (SIGIO, SIGALRM, ...) are still
+ * delivered to the server thread. Returns pthread_create()'s result.
+ */
+
+int
+VERMILIONCreateThread(pthread_t *thread, void *(*proc) (void *), void *arg)
+{
+    sigset_t all, old;
+    int ret;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(thread, NULL, proc, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return ret;
+}
@@ -0,0 +1,259 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vermilion_test.h"
+#include "vermilion_heap.h"
+
+/*
+ * Exercises the offscreen heap: splitting and merging, eviction order,
+ * pinning, and the statistics, checking the block list after every step.
+ */
+
+#define ALIGN 64
+
+/* Owners are indices into this, and record the order they're evicted in */
+static int owners[16];
+static int refuse[16];
+static int evicted[16];
+static int nEvicted;
+
+static int
+evictOwner(void *closure, void *owner)
+{
+    int i = (int *)owner - owners;
+
+    (void)closure;
+
+    if (refuse[i])
+	return 0;
+    evicted[nEvicted++] = i;
+    return 1;
+}
+
+/*
+ * The blocks tile the heap in address order with no two free blocks next
+ * to each other, and the statistics agree with them.
+ */
+static void
+checkHeap(VERMILIONHeapPtr heap)
+{
+    VERMILIONHeapBlockPtr block;
+    VERMILIONHeapStatsRec stats;
+    unsigned long offset = heap->offset;
+    unsigned long used = 0, usedBlocks = 0, freeBlocks = 0, largest = 0;
+    int prevFree = 0;
+
+    for (block = heap->blocks; block; block = block->next) {
+	VERMILION_CHECK(block->offset == offset);
+	VERMILION_CHECK(block->size && block->size % ALIGN == 0);
+	VERMILION_CHECK(!block->next || block->next->prev == block);
+	offset += block->size;
+
+	if (block->owner) {
+	    used += block->size;
+	    usedBlocks++;
+	    prevFree = 0;
+	} else {
+	    VERMILION_CHECK(!prevFree);
+	    freeBlocks++;
+	    largest = max(largest, block->size);
+	    prevFree = 1;
+	}
+    }
+    VERMILION_CHECK(offset == heap->offset + heap->size);
+
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.bytesUsed == used);
+    VERMILION_CHECK(stats.usedBlocks == usedBlocks);
+    VERMILION_CHECK(stats.allocs - stats.frees == usedBlocks);
+    VERMILION_CHECK(stats.evictions <= stats.frees);
+    VERMILION_CHECK(stats.bytesPeak >= stats.bytesUsed);
+    VERMILION_CHECK(stats.freeBlocks == freeBlocks);
+    VERMILION_CHECK(stats.largestFree == largest);
+}
+
+static void
+checkSplitMerge(void)
+{
+    VERMILIONHeapPtr heap;
+    VERMILIONHeapBlockPtr a, b, c;
+    VERMILIONHeapStatsRec stats;
+
+    /* The range is trimmed to whole aligned units */
+    heap = VERMILIONHeapCreate(100, 1024, ALIGN, NULL, NULL);
+    VERMILION_CHECK(heap);
+    VERMILION_CHECK(heap->offset == 128 && heap->size == 960);
+    VERMILIONHeapDestroy(heap);
+
+    heap = VERMILIONHeapCreate(0, 1024, ALIGN, NULL, NULL);
+    VERMILION_CHECK(heap);
+    checkHeap(heap);
+
+    a = VERMILIONHeapAlloc(heap, 1, &owners[0], 0);
+    b = VERMILIONHeapAlloc(heap, 100, &owners[1], 0);
+    c = VERMILIONHeapAlloc(heap, 64, &owners[2], 0);
+    VERMILION_CHECK(a && b && c);
+    VERMILION_CHECK(a->offset == 0 && a->size == 64);
+    VERMILION_CHECK(b->offset == 64 && b->size == 128);
+    VERMILION_CHECK(c->offset == 192 && c->size == 64);
+    checkHeap(heap);
+
+    /* A hole between two used blocks stays on its own */
+    VERMILIONHeapFree(heap, b);
+    checkHeap(heap);
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.freeBlocks == 2 && stats.largestFree == 768);
+
+    /* and is reused for a request that fits it */
+    b = VERMILIONHeapAlloc(heap, 64, &owners[1], 0);
+    VERMILION_CHECK(b && b->offset == 64);
+    checkHeap(heap);
+
+    /* Freeing merges with the free neighbours on both sides */
+    VERMILIONHeapFree(heap, a);
+    checkHeap(heap);
+    VERMILIONHeapFree(heap, b);
+    checkHeap(heap);
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.freeBlocks == 2 && stats.largestFree == 768);
+    VERMILIONHeapFree(heap, c);
+    checkHeap(heap);
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.freeBlocks == 1 && stats.largestFree == 1024);
+    VERMILION_CHECK(stats.bytesPeak == 256);
+
+    /* Too big, or no owner */
+    VERMILION_CHECK(!VERMILIONHeapAlloc(heap, 1025, &owners[0], 0));
+    VERMILION_CHECK(!VERMILIONHeapAlloc(heap, 64, NULL, 0));
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.failures == 2);
+
+    VERMILIONHeapDestroy(heap);
+}
+
+static VERMILIONHeapPtr
+fullHeap(VERMILIONHeapBlockPtr *blocks)
+{
+    VERMILIONHeapPtr heap;
+    int i;
+
+    heap = VERMILIONHeapCreate(0, 4 * 256, ALIGN, evictOwner, NULL);
+    VERMILION_CHECK(heap);
+    for (i = 0; i < 4; i++) {
+	blocks[i] = VERMILIONHeapAlloc(heap, 256, &owners[i], 0);
+	VERMILION_CHECK(blocks[i]);
+	refuse[i] = 0;
+    }
+    nEvicted = 0;
+    checkHeap(heap);
+
+    return heap;
+}
+
+static void
+checkEviction(void)
+{
+    VERMILIONHeapPtr heap;
+    VERMILIONHeapBlockPtr blocks[4], block;
+    VERMILIONHeapStatsRec stats;
+
+    /* Without evict set a full heap fails and nobody is asked */
+    heap = fullHeap(blocks);
+    VERMILION_CHECK(!VERMILIONHeapAlloc(heap, 256, &owners[4], 0));
+    VERMILION_CHECK(nEvicted == 0);
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.failures == 1 && stats.evictions == 0);
+    checkHeap(heap);
+    VERMILIONHeapDestroy(heap);
+
+    /* Least recently used first, touching moves a block to the front */
+    heap = fullHeap(blocks);
+    VERMILIONHeapTouch(heap, blocks[0]);
+    VERMILIONHeapTouch(heap, blocks[2]);
+    block = VERMILIONHeapAlloc(heap, 256, &owners[4], 1);
+    VERMILION_CHECK(block && block->offset == blocks[1]->offset);
+    VERMILION_CHECK(nEvicted == 1 && evicted[0] == 1);
+    checkHeap(heap);
+
+    /*
+     * Strictly in LRU order until two neighbours are free, even though 0
+     * doesn't help: 3, 0, then 2 next to 3.
+     */
+    block = VERMILIONHeapAlloc(heap, 512, &owners[5], 1);
+    VERMILION_CHECK(nEvicted == 4 && evicted[1] == 3 && evicted[2] == 0 &&
+	evicted[3] == 2);
+    VERMILION_CHECK(block && block->offset == 512);
+    checkHeap(heap);
+    VERMILIONHeapGetStats(heap, &stats);
+    VERMILION_CHECK(stats.evictions == 4);
+    VERMILIONHeapDestroy(heap);
+
+    /* Pinned blocks and owners that refuse are skipped */
+    heap = fullHeap(blocks);
+    VERMILIONHeapPin(heap, blocks[0]);
+    refuse[1] = 1;
+    block = VERMILIONHeapAlloc(heap, 256, &owners[4], 1);
+    VERMILION_CHECK(block && block->offset == 512);
+    VERMILION_CHECK(nEvicted == 1 && evicted[0] == 2);
+    checkHeap(heap);
+
+    /*
+     * Once unpinned, a block is the most recently used. 1 goes first and
+     * joins the hole 4 leaves.
+     */
+    VERMILIONHeapUnpin(heap, blocks[0]);
+    refuse[1] = 0;
+    VERMILIONHeapFree(heap, block);
+    block = VERMILIONHeapAlloc(heap, 512, &owners[4], 1);
+    VERMILION_CHECK(nEvicted == 2 && evicted[1] == 1);
+    VERMILION_CHECK(block && block->offset == 256);
+    checkHeap(heap);
+
+    /* Nothing left that can go */
+    VERMILIONHeapPin(heap, blocks[0]);
+    VERMILIONHeapPin(heap, blocks[3]);
+    VERMILIONHeapPin(heap, block);
+    VERMILION_CHECK(!VERMILIONHeapAlloc(heap, 256, &owners[5], 1));
+    VERMILION_CHECK(nEvicted == 2);
+    checkHeap(heap);
+    VERMILIONHeapDestroy(heap);
+}
+
+int
+main(void)
+{
+    checkSplitMerge();
+    checkEviction();
+
+    return 0;
+}
@@ -0,0 +1,351 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "vermilion_test.h"
+#include "vermilion_kernels.h"
+
+/*
+ * Runs the ShadowMBX staging loop against a model of the MBX: the hooks
+ * write the same slave port packets as VERMILIONMBXUpload() and
+ * VERMILIONMBXEmitSeq(), and a decoder executes them on a simulated VRAM
+ * only as far as it's made to, at random points or when a fence is
+ * waited for. Packing into a half before the MBX is done reading it then
+ * shows up as the wrong pixels on screen.
+ */
+
+/* Block headers and flags, as in vermilion_mbx.h */
+#define MBX2D_SRC_OFF_BH	0x30000000
+#define MBX2D_FENCE_BH		0x70000000
+#define MBX2D_BLIT_BH		0x80000000
+#define MBX2D_SRC_CTRL_BH	0x90000000
+#define MBX2D_DST_CTRL_BH	0xA0000000
+#define MBX2D_USE_PAT		0x00010000
+#define MBX2D_SRC_FBMEM		0x04000000
+#define MBX2D_SRC_8888ARGB	0x00060000
+#define ROP_S			0xCC
+#define ROP_P			0xF0
+
+#define MBX_FENCE_SLOTS		16
+
+#define WIDTH 237		       /* displayWidth, less than the stride */
+#define HEIGHT 150
+#define STRIDE 256		       /* in pixels */
+#define STAGE_SIZE 8192		       /* per half, a few rows at a time */
+#define VRAM_BASE 0x08000000	       /* device address of vram[0] */
+#define FB_SIZE (STRIDE * HEIGHT * 4)
+#define VRAM_SIZE (FB_SIZE + 2 * STAGE_SIZE + MBX_FENCE_SLOTS * 4)
+#define SLOT(seq) (FB_SIZE + 2 * STAGE_SIZE + ((seq) % MBX_FENCE_SLOTS) * 4)
+
+#define MAX_CMDS (1 << 20)
+
+static CARD8 vram[VRAM_SIZE] __attribute__ ((aligned(32)));
+static FbBits shadow[STRIDE * HEIGHT];
+static VERMILIONShadowStageRec stage;
+
+/* The slave port, and how far the MBX has got through it */
+static CARD32 cmds[MAX_CMDS];
+static int nCmds, executed;
+
+/* The driver's side: the surface state cache and the sequence numbers */
+static CARD32 cacheSrcCtrl, cacheSrcAddr, cacheDstCtrl, cacheDstAddr;
+static Bool cacheValid;
+static CARD32 seqEmitted;
+static Bool dirty;
+
+/* The MBX's registers */
+static CARD32 srcCtrl, srcAddr, dstCtrl, dstAddr;
+
+static CARD32 seed = 1;
+
+static CARD32
+random32(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8 ^ seed << 16;
+}
+
+static CARD8 *
+vramAt(CARD32 addr, unsigned long len)
+{
+    VERMILION_CHECK(addr >= VRAM_BASE && addr + len <= VRAM_BASE + VRAM_SIZE);
+    return vram + (addr - VRAM_BASE);
+}
+
+static void
+writeCmd(CARD32 word)
+{
+    VERMILION_CHECK(nCmds < MAX_CMDS);
+    cmds[nCmds++] = word;
+}
+
+static void
+setSurface(CARD32 bh, CARD32 ctrl, CARD32 addr, CARD32 * cacheCtrl,
+    CARD32 * cacheAddr)
+{
+    if (cacheValid && *cacheCtrl == ctrl && *cacheAddr == addr)
+	return;
+    writeCmd(bh | ctrl);
+    writeCmd(addr);
+    *cacheCtrl = ctrl;
+    *cacheAddr = addr;
+}
+
+/*
+ * Decode and execute one packet.
+ */
+static void
+mbxStep(void)
+{
+    CARD32 bh = cmds[executed++];
+    CARD32 colour = 0, tl, br;
+    int x1, y1, x2, y2, x, y, bpp, rop;
+    int srcPitch, dstPitch;
+
+    switch (bh & 0xf0000000) {
+    case MBX2D_SRC_CTRL_BH:
+	srcCtrl = bh & 0x0fffffff;
+	srcAddr = cmds[executed++];
+	break;
+    case MBX2D_DST_CTRL_BH:
+	dstCtrl = bh & 0x0fffffff;
+	dstAddr = cmds[executed++];
+	break;
+    case MBX2D_SRC_OFF_BH:
+    case MBX2D_FENCE_BH:
+	break;
+    case MBX2D_BLIT_BH:
+	rop = bh & 0xff;
+	VERMILION_CHECK(rop == ROP_S || rop == ROP_P);
+	VERMILION_CHECK((int)((bh >> 8) & 0xff) == rop);
+	if (rop == ROP_P)
+	    colour = cmds[executed++];
+	tl = cmds[executed++];
+	br = cmds[executed++];
+	x1 = tl >> 16;
+	y1 = tl & 0xffff;
+	x2 = br >> 16;
+	y2 = br & 0xffff;
+	VERMILION_CHECK(x1 < x2 && y1 < y2);
+	VERMILION_CHECK((dstCtrl & MBX2D_SRC_8888ARGB) == MBX2D_SRC_8888ARGB);
+	bpp = 4;
+	dstPitch = dstCtrl & 0xffff;
+
+	for (y = y1; y < y2; y++)
+	    for (x = x1; x < x2; x++) {
+		CARD32 *dst = (CARD32 *) vramAt(dstAddr + y * dstPitch +
+		    x * bpp, bpp);
+
+		if (rop == ROP_P) {
+		    *dst = colour;
+		    continue;
+		}
+		VERMILION_CHECK(srcCtrl & MBX2D_SRC_FBMEM);
+		VERMILION_CHECK((srcCtrl & MBX2D_SRC_8888ARGB) ==
+		    MBX2D_SRC_8888ARGB);
+		srcPitch = srcCtrl & 0xffff;
+		*dst = *(CARD32 *) vramAt(srcAddr + (y - y1) * srcPitch +
+		    (x - x1) * bpp, bpp);
+	    }
+	break;
+    default:
+	VERMILION_CHECK(!"unknown block header");
+    }
+}
+
+static void
+mbxRun(int upto)
+{
+    while (executed < upto)
+	mbxStep();
+}
+
+static Bool
+seqPassed(CARD32 seq)
+{
+    CARD32 hw = *(CARD32 *) (vram + SLOT(seq));
+
+    return (short)((hw - seq) & 0xffff) >= 0;
+}
+
+static void
+stageUpload(void *closure, CARD32 addr, int pitch, int x, int y, int w, int h)
+{
+    int half = stage.cur;
+
+    (void)closure;
+
+    /* The rows are packed into the half being filled, and fit in it */
+    VERMILION_CHECK(pitch % VERMILION_STAGE_ALIGN == 0 && pitch >= w * 4);
+    VERMILION_CHECK(addr >= stage.devAddr[half] &&
+	addr + (CARD32) pitch * h <= stage.devAddr[half] + stage.size);
+    VERMILION_CHECK(x >= 0 && x + w <= WIDTH && y >= 0 && y + h <= HEIGHT);
+
+    setSurface(MBX2D_SRC_CTRL_BH, MBX2D_SRC_FBMEM | MBX2D_SRC_8888ARGB |
+	pitch, addr, &cacheSrcCtrl, &cacheSrcAddr);
+    setSurface(MBX2D_DST_CTRL_BH, MBX2D_SRC_8888ARGB | STRIDE * 4,
+	VRAM_BASE, &cacheDstCtrl, &cacheDstAddr);
+    cacheValid = TRUE;
+
+    writeCmd(MBX2D_SRC_OFF_BH);
+    writeCmd(MBX2D_BLIT_BH | MBX2D_USE_PAT | ROP_S << 8 | ROP_S);
+    writeCmd(x << 16 | y);
+    writeCmd((x + w) << 16 | (y + h));
+    writeCmd(MBX2D_FENCE_BH);
+    dirty = TRUE;
+
+    /* The MBX gets some of the way through what's queued */
+    if (random32() % 4 == 0)
+	mbxRun(executed + random32() % (nCmds - executed + 1));
+}
+
+static CARD32
+stageEmitSeq(void *closure)
+{
+    (void)closure;
+
+    if (!dirty)
+	return seqEmitted;
+
+    seqEmitted++;
+    setSurface(MBX2D_DST_CTRL_BH, MBX2D_SRC_8888ARGB,
+	VRAM_BASE + SLOT(seqEmitted), &cacheDstCtrl, &cacheDstAddr);
+    writeCmd(MBX2D_BLIT_BH | ROP_P << 8 | ROP_P);
+    writeCmd(seqEmitted & 0xffff);
+    writeCmd(0);
+    writeCmd(1 << 16 | 1);
+    writeCmd(MBX2D_FENCE_BH);
+    dirty = FALSE;
+
+    return seqEmitted;
+}
+
+static void
+stageWaitSeq(void *closure, CARD32 seq)
+{
+    (void)closure;
+
+    VERMILION_CHECK((int)(seqEmitted - seq) >= 0);
+
+    while (!seqPassed(seq)) {
+	VERMILION_CHECK(executed < nCmds);
+	mbxStep();
+    }
+}
+
+static void
+sync(void)
+{
+    stageWaitSeq(NULL, stage.seq[0]);
+    stageWaitSeq(NULL, stage.seq[1]);
+}
+
+static void
+checkScreen(void)
+{
+    int y;
+
+    for (y = 0; y < HEIGHT; y++)
+	VERMILION_CHECK(!memcmp(vram + y * STRIDE * 4, shadow + y * STRIDE,
+		WIDTH * 4));
+}
+
+/*
+ * Draw something new into a few random boxes of the shadow and upload
+ * them. Some reach past displayWidth into the stride padding.
+ */
+static void
+frame(void)
+{
+    BoxRec boxes[8];
+    int nbox = 1 + random32() % 8, i, x, y;
+    unsigned long written, expect = 0;
+
+    for (i = 0; i < nbox; i++) {
+	boxes[i].x1 = random32() % STRIDE;
+	boxes[i].y1 = random32() % HEIGHT;
+	boxes[i].x2 = boxes[i].x1 + 1 + random32() % (STRIDE - boxes[i].x1);
+	boxes[i].y2 = boxes[i].y1 + 1 + random32() % (HEIGHT - boxes[i].y1);
+	if (boxes[i].x2 > WIDTH && random32() % 2)
+	    boxes[i].x2 = WIDTH;
+	if (boxes[i].x1 >= WIDTH)
+	    boxes[i].x1 = boxes[i].x2 = 0;
+	for (y = boxes[i].y1; y < boxes[i].y2; y++)
+	    for (x = boxes[i].x1; x < boxes[i].x2; x++)
+		shadow[y * STRIDE + x] = random32();
+	expect += (unsigned long)(boxes[i].x2 - boxes[i].x1) *
+	    (boxes[i].y2 - boxes[i].y1);
+    }
+
+    written = VERMILIONShadowStageBits(&stage, shadow, STRIDE, 32, WIDTH,
+	boxes, nbox,
+	VERMILIONShadowKernels[VERMILIONNumShadowKernels - 1].copy24, NULL);
+    VERMILION_CHECK(written == expect);
+
+    /* Whatever was packed has been fenced */
+    VERMILION_CHECK(stage.used == 0 && !dirty);
+}
+
+int
+main(void)
+{
+    int i;
+
+    stage.size = STAGE_SIZE;
+    stage.upload = stageUpload;
+    stage.emitSeq = stageEmitSeq;
+    stage.waitSeq = stageWaitSeq;
+    for (i = 0; i < 2; i++) {
+	stage.map[i] = (char *)vram + FB_SIZE + i * STAGE_SIZE;
+	stage.devAddr[i] = VRAM_BASE + FB_SIZE + i * STAGE_SIZE;
+	stage.seq[i] = stageEmitSeq(NULL);
+    }
+
+    for (i = 0; i < 2000; i++) {
+	frame();
+	if (random32() % 16 == 0) {
+	    sync();
+	    checkScreen();
+	}
+    }
+
+    sync();
+    mbxRun(nCmds);
+    checkScreen();
+
+    /* The fences went round the slots many times over */
+    VERMILION_CHECK(seqEmitted > 4 * MBX_FENCE_SLOTS);
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "vermilion_test.h"
+#include "vermilion_kernels.h"
+
+/*
+ * Checks every shadow upload kernel this CPU supports against the plain C
+ * one on a few typical damage patterns, and prints how fast each is when
+ * copying between two buffers in system memory. Also checks the depth 15
+ * wfb accessors.
+ */
+
+#define WIDTH 1024
+#define HEIGHT 768
+
+/*
+ * How long each kernel runs on each damage pattern.
+ */
+#define BENCHMARK_USECS 20000
+
+typedef struct _BenchPattern
+{
+    const char *name;
+    int (*boxes) (BoxPtr pbox, int width, int height);
+} BenchPattern;
+
+#define MAX_BOXES (WIDTH / 9)
+
+static int
+fullScreen(BoxPtr pbox, int width, int height)
+{
+    pbox->x1 = 0;
+    pbox->y1 = 0;
+    pbox->x2 = width;
+    pbox->y2 = height;
+    return 1;
+}
+
+/*
+ * A terminal scrolling by one line: most of the width, most of the height.
+ */
+static int
+scroll(BoxPtr pbox, int width, int height)
+{
+    pbox->x1 = width / 8 + 1;
+    pbox->y1 = height / 8;
+    pbox->x2 = width - width / 8;
+    pbox->y2 = height - height / 8;
+    return 1;
+}
+
+/*
+ * Typing: a glyph and a cursor sized box per cell along a text line.
+ */
+static int
+text(BoxPtr pbox, int width, int height)
+{
+    int n = width / 9, i;
+
+    for (i = 0; i < n; i++) {
+	pbox[i].x1 = i * 9;
+	pbox[i].y1 = (height / 2) + (i & 1) * 16;
+	pbox[i].x2 = i * 9 + 8;
+	pbox[i].y2 = pbox[i].y1 + 16;
+    }
+    return n;
+}
+
+/*
+ * A 720x576 video window at an odd x.
+ */
+static int
+video(BoxPtr pbox, int width, int height)
+{
+    pbox->x1 = min(33, width);
+    pbox->y1 = min(32, height);
+    pbox->x2 = min(pbox->x1 + 720, width);
+    pbox->y2 = min(pbox->y1 + 576, height);
+    return 1;
+}
+
+static const BenchPattern patterns[] = {
+    {"full screen", fullScreen},
+    {"scroll", scroll},
+    {"text", text},
+    {"video", video},
+};
+
+#define NUM_PATTERNS (int)(sizeof(patterns) / sizeof(patterns[0]))
+
+static FbBits *
+allocBits(size_t size)
+{
+    void *p = NULL;
+
+    VERMILION_CHECK(posix_memalign(&p, 32, size) == 0);
+    return p;
+}
+
+static int
+checkDepth(int depth)
+{
+    const VERMILIONShadowKernel *kernel;
+    const VERMILIONShadowKernel *plain =
+	&VERMILIONShadowKernels[VERMILIONNumShadowKernels - 1];
+    VERMILIONCopyRowProc copyRow, ref;
+    void (*fence) (void);
+    int bpp = (depth == 15) ? 16 : 32;
+    FbStride stride = WIDTH * bpp / FB_UNIT;
+    size_t size = stride * HEIGHT * sizeof(FbBits);
+    FbBits *sha, *dst, *expect;
+    BoxRec boxes[MAX_BOXES];
+    unsigned long long start, elapsed, bytes;
+    unsigned long i, iter;
+    CARD32 seed = 1;
+    int k, p, stream, nbox, failed = 0;
+    Bool ok;
+
+    ref = (depth == 15) ? plain->copy15 : plain->copy24;
+
+    sha = allocBits(size);
+    dst = allocBits(size);
+    expect = allocBits(size);
+
+    for (i = 0; i < size / sizeof(FbBits); i++) {
+	seed = seed * 1103515245 + 12345;
+	sha[i] = seed;
+    }
+
+    for (p = 0; p < NUM_PATTERNS; p++) {
+	nbox = patterns[p].boxes(boxes, WIDTH, HEIGHT);
+
+	memset(expect, 0, size);
+	VERMILIONShadowCopyBits(expect, stride, sha, stride, bpp, boxes, nbox,
+	    0, MAXSHORT, ref);
+
+	/* Banded copies, as the worker threads do them, must match too */
+	memset(dst, 0, size);
+	VERMILIONShadowCopyBits(dst, stride, sha, stride, bpp, boxes, nbox,
+	    0, HEIGHT / 3, ref);
+	VERMILIONShadowCopyBits(dst, stride, sha, stride, bpp, boxes, nbox,
+	    HEIGHT / 3, MAXSHORT, ref);
+	if (memcmp(dst, expect, size)) {
+	    printf("depth %d, %s: banded copy mismatch\n", depth,
+		patterns[p].name);
+	    failed = 1;
+	}
+
+	for (k = 0; k < VERMILIONNumShadowKernels; k++) {
+	    kernel = &VERMILIONShadowKernels[k];
+	    if (kernel->supported && !kernel->supported())
+		continue;
+
+	    for (stream = 0; stream < 2; stream++) {
+		if (stream) {
+		    copyRow = (depth == 15) ?
+			kernel->stream15 : kernel->stream24;
+		    fence = kernel->fence;
+		} else {
+		    copyRow = (depth == 15) ?
+			kernel->copy15 : kernel->copy24;
+		    fence = NULL;
+		}
+		if (!copyRow)
+		    continue;
+
+		memset(dst, 0, size);
+		bytes = 0;
+		iter = 0;
+		start = VERMILIONTestUsecs();
+		do {
+		    bytes += VERMILIONShadowCopyBits(dst, stride, sha, stride,
+			bpp, boxes, nbox, 0, MAXSHORT, copyRow) *
+			sizeof(FbBits);
+		    if (fence)
+			fence();
+		    iter++;
+		    elapsed = VERMILIONTestUsecs() - start;
+		} while (elapsed < BENCHMARK_USECS);
+
+		ok = !memcmp(dst, expect, size);
+		printf("depth %d, %s%s, %s: %.2f GB/s, %.0f ns/box%s\n",
+		    depth, kernel->name, stream ? " streaming" : "",
+		    patterns[p].name,
+		    elapsed ? (double)bytes / (double)elapsed / 1000. : 0.,
+		    1000. * (double)elapsed / ((double)iter * nbox),
+		    ok ? "" : ", OUTPUT MISMATCH");
+		if (!ok)
+		    failed = 1;
+	    }
+	}
+    }
+
+    free(expect);
+    free(dst);
+    free(sha);
+
+    return failed;
+}
+
+static void
+checkAccessors(void)
+{
+    CARD8 buf[8];
+
+    memcpy(buf, "\x01\x02\x03\x04\x05\x06\x07\x08", 8);
+    VERMILION_CHECK(VERMILIONReadMemory(buf, 1) == 0x01);
+    VERMILION_CHECK(VERMILIONReadMemory(buf, 2) == 0x0201);
+    VERMILION_CHECK(VERMILIONReadMemory(buf + 1, 3) == 0x040302);
+    VERMILION_CHECK(VERMILIONReadMemory(buf, 4) == 0x04030201);
+
+    memset(buf, 0, sizeof(buf));
+    VERMILIONWriteMemoryPassthru(buf, 0x12345678, 4);
+    VERMILION_CHECK(VERMILIONReadMemory(buf, 4) == 0x12345678);
+    VERMILIONWriteMemoryPassthru(buf + 4, 0xabcd, 2);
+    VERMILION_CHECK(VERMILIONReadMemory(buf + 4, 2) == 0xabcd);
+    VERMILION_CHECK(buf[6] == 0);
+
+    /* Depth 15 writes set the top bit of every pixel they cover */
+    memset(buf, 0, sizeof(buf));
+    VERMILIONWriteMemorySetAlpha(buf, 0x00010002, 4);
+    VERMILION_CHECK(VERMILIONReadMemory(buf, 4) == 0x80018002);
+    VERMILIONWriteMemorySetAlpha(buf + 4, 0x0003, 2);
+    VERMILION_CHECK(VERMILIONReadMemory(buf + 4, 2) == 0x8003);
+    VERMILIONWriteMemorySetAlpha(buf + 6, 0x44, 1);
+    VERMILION_CHECK(buf[6] == 0x44 && buf[7] == 0);
+}
+
+int
+main(void)
+{
+    int failed;
+
+    checkAccessors();
+    failed = checkDepth(15);
+    failed |= checkDepth(24);
+
+    return failed;
+}
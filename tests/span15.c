@@ -0,0 +1,306 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "vermilion_test.h"
+#include "vermilion_kernels.h"
+
+/*
+ * Checks the depth 15 span writers against the same operations done the
+ * way wfb does them, one indirect accessor call per 32 bit word, and
+ * prints the time per operation of each, x11perf style.
+ */
+
+#define WIDTH 1024
+#define HEIGHT 768
+#define STRIDE (WIDTH * 2)
+
+#define BENCHMARK_USECS 50000
+
+typedef FbBits (*ReadProc) (const void *src, int size);
+typedef void (*WriteProc) (void *dst, FbBits value, int size);
+
+/* volatile so that the compiler can't inline the calls, as in wfb */
+static ReadProc volatile wfbRead = VERMILIONReadMemory;
+static WriteProc volatile wfbWrite = VERMILIONWriteMemorySetAlpha;
+
+static CARD8 *fb;
+static CARD8 *expect;
+static CARD16 image[WIDTH * HEIGHT];
+static CARD8 glyphs[HEIGHT * (WIDTH / 8)];
+
+/*
+ * fbSolid: masked edges read, modify and write, whole words in between.
+ */
+static void
+wfbFill(int x, int y, int w, int h, CARD32 pixel)
+{
+    CARD32 fill = (pixel & 0xffff) | pixel << 16;
+    CARD32 *line = (CARD32 *) (fb + y * STRIDE) + (x >> 1), *dst;
+    int n;
+
+    while (h--) {
+	dst = line;
+	n = w;
+	if (x & 1) {
+	    (*wfbWrite) (dst, ((*wfbRead) (dst, 4) & 0xffff) |
+		(fill & 0xffff0000), 4);
+	    dst++;
+	    n--;
+	}
+	for (; n >= 2; n -= 2, dst++)
+	    (*wfbWrite) (dst, fill, 4);
+	if (n)
+	    (*wfbWrite) (dst, ((*wfbRead) (dst, 4) & 0xffff0000) |
+		(fill & 0xffff), 4);
+	line += STRIDE / 4;
+    }
+}
+
+/*
+ * fbBlt for a PutImage: whole words, the source read directly.
+ */
+static void
+wfbPutImage(int x, int y, int w, int h)
+{
+    CARD16 *dst, *src = image;
+    int i;
+
+    while (h--) {
+	dst = (CARD16 *) (fb + y++ * STRIDE) + x;
+	for (i = 0; i + 1 < w; i += 2)
+	    (*wfbWrite) (dst + i, src[i] | (CARD32) src[i + 1] << 16, 4);
+	if (i < w)
+	    (*wfbWrite) (dst + i, src[i], 2);
+	src += WIDTH;
+    }
+}
+
+/*
+ * fbBltOne for a transparent glyph: read, modify and write each word
+ * with a set pixel.
+ */
+static void
+wfbGlyph(int x, int y, int w, int h, const CARD8 *bits, int fg)
+{
+    CARD32 *word, v;
+    int i, px;
+
+    while (h--) {
+	for (i = 0; i < w; i++) {
+	    if (!(bits[i >> 3] & (1 << (i & 7))))
+		continue;
+	    px = x + i;
+	    word = (CARD32 *) (fb + y * STRIDE) + (px >> 1);
+	    v = (*wfbRead) (word, 4);
+	    if (px & 1)
+		v = (v & 0xffff) | (CARD32) fg << 16;
+	    else
+		v = (v & 0xffff0000) | fg;
+	    (*wfbWrite) (word, v, 4);
+	}
+	bits += WIDTH / 8;
+	y++;
+    }
+}
+
+static void
+spanFill(int x, int y, int w, int h, CARD32 pixel)
+{
+    while (h--)
+	VERMILIONFillSpan15((CARD16 *) (fb + y++ * STRIDE) + x, w, pixel);
+}
+
+static void
+spanPutImage(int x, int y, int w, int h)
+{
+    CARD16 *src = image;
+
+    while (h--) {
+	VERMILIONWriteSpan15((CARD16 *) (fb + y++ * STRIDE) + x, src, w);
+	src += WIDTH;
+    }
+}
+
+static void
+spanGlyph(int x, int y, int w, int h, const CARD8 *bits, int fg)
+{
+    while (h--) {
+	VERMILIONExpandSpan15((CARD16 *) (fb + y++ * STRIDE) + x, bits, 0, w,
+	    fg, -1);
+	bits += WIDTH / 8;
+    }
+}
+
+typedef struct _Op
+{
+    const char *name;
+    int w, h;
+    int kind;
+} Op;
+
+enum { FILL, PUTIMAGE, GLYPH };
+
+static const Op ops[] = {
+    {"10x10 rectangle", 10, 10, FILL},
+    {"100x100 rectangle", 100, 100, FILL},
+    {"500x500 rectangle", 500, 500, FILL},
+    {"10x10 PutImage", 10, 10, PUTIMAGE},
+    {"100x100 PutImage", 100, 100, PUTIMAGE},
+    {"500x500 PutImage", 500, 500, PUTIMAGE},
+    {"8x13 glyph", 8, 13, GLYPH},
+    {"80 char line", 640, 13, GLYPH},
+};
+
+#define NUM_OPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+static void
+runOp(const Op *op, Bool wfb, int x, int y)
+{
+    switch (op->kind) {
+    case FILL:
+	if (wfb)
+	    wfbFill(x, y, op->w, op->h, 0x1234);
+	else
+	    spanFill(x, y, op->w, op->h, 0x1234);
+	break;
+    case PUTIMAGE:
+	if (wfb)
+	    wfbPutImage(x, y, op->w, op->h);
+	else
+	    spanPutImage(x, y, op->w, op->h);
+	break;
+    case GLYPH:
+	if (wfb)
+	    wfbGlyph(x, y, op->w, op->h, glyphs, 0x4321);
+	else
+	    spanGlyph(x, y, op->w, op->h, glyphs, 0x4321);
+	break;
+    }
+}
+
+/*
+ * Microseconds per operation, at x offsets cycling through both
+ * alignments.
+ */
+static double
+timeOp(const Op *op, Bool wfb)
+{
+    unsigned long long start, elapsed;
+    unsigned long iter = 0;
+
+    start = VERMILIONTestUsecs();
+    do {
+	runOp(op, wfb, 1 + (iter & 7), 1 + (iter & 15));
+	iter++;
+	elapsed = VERMILIONTestUsecs() - start;
+    } while (elapsed < BENCHMARK_USECS);
+
+    return (double)elapsed / (double)iter;
+}
+
+static void
+checkExpand(void)
+{
+    static const CARD8 bits[4] = { 0xa5, 0x00, 0x00, 0x81 };
+    CARD16 dst[32];
+    int skip, w, i, set;
+
+    for (skip = 0; skip < 8; skip++) {
+	for (w = 1; w <= 32 - skip; w++) {
+	    memset(dst, 0, sizeof(dst));
+	    VERMILIONExpandSpan15(dst, bits, skip, w, 0x1111, -1);
+	    for (i = 0; i < 32; i++) {
+		set = i < w &&
+		    (bits[(skip + i) >> 3] & (1 << ((skip + i) & 7)));
+		VERMILION_CHECK(dst[i] == (set ? 0x9111 : 0));
+	    }
+
+	    VERMILIONExpandSpan15(dst, bits, skip, w, 0x1111, 0x2222);
+	    for (i = 0; i < w; i++) {
+		set = bits[(skip + i) >> 3] & (1 << ((skip + i) & 7));
+		VERMILION_CHECK(dst[i] == (set ? 0x9111 : 0xa222));
+	    }
+	}
+    }
+}
+
+int
+main(void)
+{
+    CARD32 seed = 1;
+    double wfb, span;
+    int i, o;
+
+    fb = malloc(STRIDE * HEIGHT);
+    expect = malloc(STRIDE * HEIGHT);
+    VERMILION_CHECK(fb && expect);
+
+    for (i = 0; i < WIDTH * HEIGHT; i++) {
+	seed = seed * 1103515245 + 12345;
+	image[i] = seed >> 16;
+    }
+    /* Sparse enough to look like text */
+    for (i = 0; i < (int)sizeof(glyphs); i++) {
+	seed = seed * 1103515245 + 12345;
+	glyphs[i] = (seed >> 16) & (seed >> 24);
+    }
+
+    checkExpand();
+
+    for (o = 0; o < NUM_OPS; o++) {
+	for (i = 0; i < 16; i++) {
+	    /* Every pixel in the framebuffer has its alpha bit set */
+	    memset(fb, 0xda, STRIDE * HEIGHT);
+	    runOp(&ops[o], TRUE, 1 + (i & 7), 1 + i);
+	    memcpy(expect, fb, STRIDE * HEIGHT);
+	    memset(fb, 0xda, STRIDE * HEIGHT);
+	    runOp(&ops[o], FALSE, 1 + (i & 7), 1 + i);
+	    if (memcmp(fb, expect, STRIDE * HEIGHT)) {
+		printf("%s: span output differs from wfb\n", ops[o].name);
+		return 1;
+	    }
+	}
+
+	wfb = timeOp(&ops[o], TRUE);
+	span = timeOp(&ops[o], FALSE);
+	printf("%s: wfb %.2f us, span %.2f us, %.1fx\n", ops[o].name, wfb,
+	    span, wfb / span);
+    }
+
+    free(expect);
+    free(fb);
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef _VERMILION_TEST_H_
+#define _VERMILION_TEST_H_
+
+/*
+ * Just enough of the server's types for the parts of the driver that don't
+ * otherwise need it to build outside the server, with -DVERMILION_TEST.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+typedef int Bool;
+
+#define TRUE 1
+#define FALSE 0
+
+typedef uint8_t CARD8;
+typedef uint16_t CARD16;
+typedef uint32_t CARD32;
+
+/* fb.h */
+typedef CARD32 FbBits;
+typedef int FbStride;
+
+#define FB_SHIFT 5
+#define FB_UNIT (1 << FB_SHIFT)
+#define FB_MASK (FB_UNIT - 1)
+
+/* regionstr.h */
+typedef struct _Box
+{
+    short x1, y1, x2, y2;
+} BoxRec, *BoxPtr;
+
+typedef struct _RegData
+{
+    long size;
+    long numRects;
+} RegDataRec, *RegDataPtr;
+
+typedef struct _Region
+{
+    BoxRec extents;
+    RegDataPtr data;
+} RegionRec, *RegionPtr;
+
+/* misc.h */
+#define X_LITTLE_ENDIAN 1234
+#define X_BIG_ENDIAN 4321
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define X_BYTE_ORDER X_BIG_ENDIAN
+#else
+#define X_BYTE_ORDER X_LITTLE_ENDIAN
+#endif
+
+#define MAXSHORT 32767
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define FatalError(...) \
+    do { fprintf(stderr, __VA_ARGS__); abort(); } while (0)
+
+/*
+ * Test helpers.
+ */
+
+#define VERMILION_CHECK(cond)						\
+    do {								\
+	if (!(cond)) {							\
+	    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,	\
+		__LINE__, #cond);					\
+	    exit(1);							\
+	}								\
+    } while (0)
+
+static inline unsigned long long
+VERMILIONTestUsecs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+#endif /* _VERMILION_TEST_H_ */
@@ -0,0 +1,264 @@
+/**************************************************************************
+ *
+ * Copyright (c) Intel Corp. 2007.
+ * All Rights Reserved.
+ *
+ * Intel funded Tungsten Graphics (http://www.tungstengraphics.com) to
+ * develop this driver.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "vermilion_kernel.h"
+#include "vermilion_test.h"
+#include "vermilion_heap.h"
+#include "vermilion_vram.h"
+
+/*
+ * Runs the VRAM chunk query against an ioctl stub that hands out
+ * fragmented chunks, and sets up the pixmap pools over what it found.
+ */
+
+#define ALIGN 32
+#define MAX_STUB_CHUNKS 12
+
+typedef struct _StubDevice
+{
+    int numChunks;
+    vml_vram_chunk_t chunks[MAX_STUB_CHUNKS];
+    int failAt;			       /* chunk index to fail with failErrno */
+    int failErrno;
+    int asked[MAX_STUB_CHUNKS + 2];    /* chunk indices in the order asked */
+    int numAsked;
+} StubDevice;
+
+static int
+stubIoctl(void *closure, unsigned long request, void *arg)
+{
+    StubDevice *dev = closure;
+    vml_vram_chunk_t *chunk = arg;
+    unsigned index = chunk->index;
+
+    if (request != VML_VRAM_CHUNK) {
+	errno = ENOTTY;
+	return -1;
+    }
+
+    VERMILION_CHECK(dev->numAsked < MAX_STUB_CHUNKS + 2);
+    dev->asked[dev->numAsked++] = index;
+
+    if (dev->failErrno && (int)index >= dev->failAt) {
+	errno = dev->failErrno;
+	return -1;
+    }
+    if (index < 1 || index > (unsigned)dev->numChunks) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    *chunk = dev->chunks[index - 1];
+    chunk->index = index;
+    return 0;
+}
+
+/*
+ * Chunks out of address order, of sizes that aren't a multiple of the
+ * pixmap alignment, some starting off alignment.
+ */
+static void
+stubFragmented(StubDevice * dev, int n)
+{
+    int i;
+
+    memset(dev, 0, sizeof(*dev));
+    dev->numChunks = n;
+    for (i = 0; i < n; i++) {
+	dev->chunks[i].phys_offset = 0x30000000 - i * 0x01000000 + i * 8;
+	dev->chunks[i].size = 65536 + i * 4096 + i * 3;
+	dev->chunks[i].mmap_offset = (i + 1) * 0x100000;
+    }
+}
+
+static void
+checkAsked(const StubDevice * dev, int n)
+{
+    int i;
+
+    VERMILION_CHECK(dev->numAsked == n);
+    for (i = 0; i < n; i++)
+	VERMILION_CHECK(dev->asked[i] == i + 1);
+}
+
+static void
+checkQuery(void)
+{
+    VERMILIONVRAMChunkRec chunks[VERMILION_MAX_VRAM_CHUNKS];
+    StubDevice dev;
+    int n, err, i;
+
+    /* Three chunks, then EINVAL */
+    stubFragmented(&dev, 3);
+    n = VERMILIONVRAMQueryChunks(stubIoctl, &dev, chunks, &err);
+    VERMILION_CHECK(n == 3 && err == 0);
+    checkAsked(&dev, 4);
+    for (i = 0; i < n; i++) {
+	VERMILION_CHECK(chunks[i].devAddr == dev.chunks[i].phys_offset);
+	VERMILION_CHECK(chunks[i].size == dev.chunks[i].size);
+	VERMILION_CHECK(chunks[i].mmapOffset == dev.chunks[i].mmap_offset);
+	VERMILION_CHECK(chunks[i].map == NULL);
+    }
+
+    /* A kernel without VML_VRAM_CHUNK */
+    stubFragmented(&dev, 0);
+    dev.failAt = 1;
+    dev.failErrno = ENOTTY;
+    n = VERMILIONVRAMQueryChunks(stubIoctl, &dev, chunks, &err);
+    VERMILION_CHECK(n == 0 && err == 0);
+    checkAsked(&dev, 1);
+
+    /* Failing part way keeps what came before and says why */
+    stubFragmented(&dev, 3);
+    dev.failAt = 2;
+    dev.failErrno = EIO;
+    n = VERMILIONVRAMQueryChunks(stubIoctl, &dev, chunks, &err);
+    VERMILION_CHECK(n == 1 && err == EIO);
+    checkAsked(&dev, 2);
+
+    /* An empty chunk ends the list */
+    stubFragmented(&dev, 4);
+    dev.chunks[2].size = 0;
+    n = VERMILIONVRAMQueryChunks(stubIoctl, &dev, chunks, &err);
+    VERMILION_CHECK(n == 2 && err == 0);
+    checkAsked(&dev, 3);
+
+    /* No more than fit, and no asking past them */
+    stubFragmented(&dev, MAX_STUB_CHUNKS);
+    n = VERMILIONVRAMQueryChunks(stubIoctl, &dev, chunks, &err);
+    VERMILION_CHECK(n == VERMILION_MAX_VRAM_CHUNKS && err == 0);
+    checkAsked(&dev, VERMILION_MAX_VRAM_CHUNKS);
+}
+
+static int
+evictNone(void *closure, void *owner)
+{
+    (void)closure;
+    (void)owner;
+
+    return 0;
+}
+
+/*
+ * Fill a pool with small surfaces and check they all land inside its
+ * piece of VRAM, at aligned device addresses.
+ */
+static void
+checkPool(VERMILIONPoolPtr pool, CARD8 * map, CARD32 devAddr,
+    unsigned long start, unsigned long end)
+{
+    VERMILIONHeapBlockPtr block;
+    unsigned long pitch, used = 0;
+    int owner;
+
+    unsigned long skew = pool->devAddr - devAddr, offset;
+
+    VERMILION_CHECK(pool->heap && skew < ALIGN && pool->map == map + skew);
+
+    while ((block = VERMILIONHeapAllocSurface(pool->heap, 100, 10, ALIGN,
+		&pitch, &owner, 0))) {
+	offset = skew + block->offset;
+	VERMILION_CHECK(offset >= start && offset + block->size <= end);
+	VERMILION_CHECK((pool->devAddr + block->offset) % ALIGN == 0);
+	memset(pool->map + block->offset, 0xa5, pitch * 10);
+	used += block->size;
+    }
+    VERMILION_CHECK(used > 0 && end - start - used < pitch * 10 + 2 * ALIGN);
+}
+
+static void
+checkPools(void)
+{
+    VERMILIONVRAMChunkRec chunks[VERMILION_MAX_VRAM_CHUNKS];
+    VERMILIONPoolRec pools[VERMILION_MAX_POOLS];
+    static CARD8 fb[65536] __attribute__ ((aligned(ALIGN)));
+    StubDevice dev;
+    int n, nChunks, err, i, p;
+
+    stubFragmented(&dev, MAX_STUB_CHUNKS);
+    nChunks = VERMILIONVRAMQueryChunks(stubIoctl, &dev, chunks, &err);
+
+    /* Chunk 3 failed to map */
+    for (i = 0; i < nChunks; i++)
+	if (i != 2)
+	    chunks[i].map = calloc(1, chunks[i].size);
+
+    n = VERMILIONVRAMInitPools(pools, fb, 0x20000000, 40000, sizeof(fb),
+	chunks, nChunks, ALIGN, evictNone, NULL);
+    VERMILION_CHECK(n == nChunks);
+
+    checkPool(&pools[0], fb, 0x20000000, 40000, sizeof(fb));
+    for (i = 0, p = 1; i < nChunks; i++) {
+	if (!chunks[i].map)
+	    continue;
+	checkPool(&pools[p++], chunks[i].map, chunks[i].devAddr, 0,
+	    chunks[i].size);
+    }
+    VERMILION_CHECK(p == n);
+
+    for (i = 0; i < n; i++)
+	VERMILIONHeapDestroy(pools[i].heap);
+
+    /* No offscreen memory in the framebuffer, every chunk mapped */
+    chunks[2].map = calloc(1, chunks[2].size);
+    n = VERMILIONVRAMInitPools(pools, fb, 0x20000000, sizeof(fb), sizeof(fb),
+	chunks, nChunks, ALIGN, evictNone, NULL);
+    VERMILION_CHECK(n == nChunks);
+    for (i = 0; i < n; i++) {
+	checkPool(&pools[i], chunks[i].map, chunks[i].devAddr, 0,
+	    chunks[i].size);
+	VERMILIONHeapDestroy(pools[i].heap);
+    }
+
+    /* Both, filling every pool there is */
+    n = VERMILIONVRAMInitPools(pools, fb, 0x20000000, 0, sizeof(fb),
+	chunks, nChunks, ALIGN, evictNone, NULL);
+    VERMILION_CHECK(n == VERMILION_MAX_POOLS);
+    for (i = 0; i < n; i++)
+	VERMILIONHeapDestroy(pools[i].heap);
+
+    for (i = 0; i < nChunks; i++)
+	free(chunks[i].map);
+}
+
+int
+main(void)
+{
+    checkQuery();
+    checkPools();
+
+    return 0;
+}